@@ -13,9 +13,10 @@ struct VertexVC {
   Color3f Color;
 };
 
-struct VertexVN {
-  Vector3f Pos;
-  Vector3f Nor;
+//SoA排列的顶点，给批量VS用
+struct VertexStreamsVN {
+  const float* Pos[3];
+  const float* Nor[3];
 };
 
 struct CBuffer {
@@ -30,18 +31,18 @@ VertexVC helloWorld[] = {
     {{0.5f, -0.75f, 0.0f}, {0.0f, 0.0f, 1.0f}}};
 CBuffer mvpBuffer;
 int main() {
-  ColorBuffer cb(width, height);
-  DepthBuffer db(width, height);
+  BufferOptions targetOptions;
+  targetOptions.Layout = BufferLayout::Tiled;
+  targetOptions.IsInitialize = false;  //每次绘制前都会Fill
+  targetOptions.IsHugePage = true;
+  ColorBuffer cb(width, height, targetOptions);
+  DepthBuffer db(width, height, targetOptions);
+  HiZBuffer hiz(width, height);
   Bitmap img(width, height);
   std::pmr::monotonic_buffer_resource buffer(16384);
+  ThreadPool workers;
   auto saveResult = [&](std::string_view path) -> void {
-    for (uint32_t x = 0; x < width; x++) {
-      for (uint32_t y = 0; y < height; y++) {
-        uint32_t c = cb(x, y).ToRGBA().ToInt32BGRA();
-        img.SetPixel(x, y, c);
-      }
-    }
-    img.FlipVertical();
+    Renderer::Resolve(cb, img, {}, &workers);
     img.SaveFile(path.data(), false);
   };
 
@@ -63,6 +64,7 @@ int main() {
     input.CBuffer = nullptr;
     input.ColorBuffer = &cb;
     input.DepthBuffer = &db;
+    input.HiZ = &hiz;
     input.FrameWidth = width;
     input.FrameHeight = height;
     PipelineMemory memory;
@@ -70,18 +72,24 @@ int main() {
 
     cb.Fill({0.0f, 0.0f, 0.0f, 1.0f});
     db.Fill(1.0f);
+    hiz.Fill(1.0f);
     Renderer::DrawTriangle(input, pso, memory);
     buffer.release();
     saveResult("hello.bmp");
   }
   {
     ImmutableModel sphere = ImmutableModel::CreateSphere(0.5f, 32);
-    auto vsSimple = [](int index, VertexShaderParams& param) -> Vector4f {
-      const VertexVN& v = param.CastVertex<VertexVN>()[index];
+    //一次变换8个顶点
+    auto vsSimpleBatch = [](const VertexBatchParams& param) -> void {
+      const VertexStreamsVN& v = param.CastVertex<VertexStreamsVN>();
       const CBuffer& cbuffer = param.CastCBuffer<CBuffer>();
-      Vector3f& out = param.CastOut<Vector3f>(index);
-      out = v.Nor;  //没有model矩阵，直接赋值完事
-      return cbuffer.mvp * v.Pos.XYZ1();
+      Array<VertexLanes, 4> pos;
+      for (size_t i = 0; i < 3; i++) {
+        pos[i] = param.Load(v.Pos[i]);
+        param.Store(i, param.Load(v.Nor[i]));  //没有model矩阵，直接赋值完事
+      }
+      pos[3] = VertexLanes(1.0f);
+      *param.ClipPos = MultiplySoA(cbuffer.mvp, pos);
     };
     auto psSimple = [](const PixelShaderParams& param, bool& isDiscard) -> Color4f {
       const Vector3f& out = param.CastIn<Vector3f>();
@@ -91,18 +99,46 @@ int main() {
       return Color4f({std::max(0.0f, cosTheta)}, 1.0f);
       return Color4f(1.0f);
     };
+    //同样的光照，一次算一列8个像素，循环可以被编译器向量化
+    auto psSimpleBatch = [](const PixelBatchParams& param, PixelBatchResult& result) -> void {
+      const float* nx = param.GetLanes(0);
+      const float* ny = param.GetLanes(1);
+      const float* nz = param.GetLanes(2);
+      Vector3f lightDir = Normalize(Vector3f(1.0f, 1.0f, 1.0f));
+      for (size_t j = 0; j < PIXEL_BATCH_SIZE; j++) {
+        float invLength = 1.0f / std::sqrt(nx[j] * nx[j] + ny[j] * ny[j] + nz[j] * nz[j]);
+        float cosTheta = (nx[j] * lightDir.X() + ny[j] * lightDir.Y() + nz[j] * lightDir.Z()) * invLength;
+        float c = std::max(0.0f, cosTheta);
+        result.R[j] = c;
+        result.G[j] = c;
+        result.B[j] = c;
+        result.A[j] = 1.0f;
+      }
+    };
 
-    VertexVN v[3];
-    PipelineState pso = Renderer::DefaultPSO(vsSimple, psSimple, sizeof(VertexVN), sizeof(Vector3f));
+    std::vector<float> streams[6];
+    for (size_t i = 0; i < 3; i++) {
+      for (size_t j = 0; j < sphere.GetVertexCount(); j++) {
+        streams[i].emplace_back(sphere.GetPositions()[j][i]);
+        streams[i + 3].emplace_back(sphere.GetNormals()[j][i]);
+      }
+    }
+    VertexStreamsVN v{{streams[0].data(), streams[1].data(), streams[2].data()},
+                      {streams[3].data(), streams[4].data(), streams[5].data()}};
+    PipelineState pso = Renderer::DefaultPSO(nullptr, psSimple, 0, sizeof(Vector3f));
+    pso.VSBatch = vsSimpleBatch;
+    pso.PSBatch = psSimpleBatch;  //线框模式用不到，还是会走psSimple
     PipelineInput input;
-    input.Vertex = reinterpret_cast<uint8_t*>(v);
+    input.Vertex = reinterpret_cast<uint8_t*>(&v);
     input.CBuffer = reinterpret_cast<uint8_t*>(&mvpBuffer);
     input.ColorBuffer = &cb;
     input.DepthBuffer = &db;
+    input.HiZ = &hiz;
     input.FrameWidth = width;
     input.FrameHeight = height;
     PipelineMemory memory;
     memory.Arena = &buffer;
+    memory.Workers = &workers;
 
     Matrix4f viewMat = LookAt(Vector3f(0.0f, 0.0f, 1.25f), Vector3f(0.0f), Vector3f(0.0f, 1.0f, 0.0f));
     Matrix4f projMat = Perspective(Radian(60.0f), (float)width / height, 0.1f, 10.0f);
@@ -110,16 +146,11 @@ int main() {
 
     cb.Fill({0.2f, 0.2f, 0.3f, 1.0f});
     db.Fill(1.0f);
+    hiz.Fill(1.0f);
 
     auto drawCall = [&]() -> void {
-      for (size_t i = 0; i < sphere.GetIndexCount(); i += 3) {  //手动input assembly
-        for (size_t j = 0; j < 3; j++) {
-          v[j].Pos = sphere.GetPositions()[sphere.GetIndices()[i + j]];
-          v[j].Nor = sphere.GetNormals()[sphere.GetIndices()[i + j]];
-        }
-        Renderer::DrawTriangle(input, pso, memory);
-        buffer.release();
-      }
+      Renderer::DrawIndexed(input, sphere.GetIndices().data(), sphere.GetIndexCount(), pso, memory);
+      buffer.release();
     };
 
     drawCall();
@@ -127,6 +158,7 @@ int main() {
 
     cb.Fill({0.2f, 0.2f, 0.3f, 1.0f});
     db.Fill(1.0f);
+    hiz.Fill(1.0f);
     pso.IsDrawFrame = true;
 
     viewMat = LookAt(Vector3f(0.0f, 0.0f, 0.0f), Vector3f(0.0f, 0.0f, 1.0f), Vector3f(0.0f, 1.0f, 0.0f));
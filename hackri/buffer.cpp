@@ -1,13 +1,161 @@
 #include <hackri/buffer.h>
 
+#include <algorithm>
+#include <cassert>
+#include <new>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <cstdlib>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
 using namespace hackri;
 
-ColorBuffer::ColorBuffer(uint32_t width, uint32_t height) noexcept
-    : Buffer2d<Color4f>(width, height) {}
-ColorBuffer::ColorBuffer(uint32_t width, uint32_t height, const Color4f* ptr) noexcept
+void* hackri::AllocateBufferMemory(size_t size, bool isHugePage) {
+  constexpr size_t hugePageSize = size_t(2) << 20;
+  const bool isUseHugePage = isHugePage && size >= hugePageSize;
+  const size_t alignment = isUseHugePage ? hugePageSize : BUFFER_ALIGNMENT;
+#if defined(_WIN32)
+  void* ptr = _aligned_malloc(size, alignment);
+#else
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, alignment, size) != 0) {
+    ptr = nullptr;
+  }
+#endif
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (isUseHugePage) {
+    madvise(ptr, size / hugePageSize * hugePageSize, MADV_HUGEPAGE);  //只是建议，失败了也没关系
+  }
+#endif
+  return ptr;
+}
+
+void hackri::FreeBufferMemory(void* ptr) noexcept {
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+
+ColorBuffer::ColorBuffer(uint32_t width, uint32_t height, const BufferOptions& options)
+    : Buffer2d<Color4f>(width, height, options) {}
+ColorBuffer::ColorBuffer(uint32_t width, uint32_t height, const Color4f* ptr)
     : Buffer2d<Color4f>(width, height, ptr) {}
 
-DepthBuffer::DepthBuffer(uint32_t width, uint32_t height) noexcept
-    : Buffer2d<float>(width, height) {}
-DepthBuffer::DepthBuffer(uint32_t width, uint32_t height, const float* ptr) noexcept
-    : Buffer2d<float>(width, height, ptr) {}
\ No newline at end of file
+DepthBuffer::DepthBuffer(uint32_t width, uint32_t height, const BufferOptions& options)
+    : Buffer2d<float>(width, height, options) {}
+DepthBuffer::DepthBuffer(uint32_t width, uint32_t height, const float* ptr)
+    : Buffer2d<float>(width, height, ptr) {}
+
+HiZBuffer::HiZBuffer(uint32_t width, uint32_t height)
+    : _width(width),
+      _height(height),
+      _block((width + BLOCK_SIZE - 1) / BLOCK_SIZE, (height + BLOCK_SIZE - 1) / BLOCK_SIZE),
+      _coarse((width + COARSE_SIZE - 1) / COARSE_SIZE, (height + COARSE_SIZE - 1) / COARSE_SIZE),
+      _isCoarseDirty(_coarse.GetWidth(), _coarse.GetHeight()) {}
+
+void HiZBuffer::Fill(float value) noexcept {
+  //不能用快速清除：这几个缓冲的一个tile覆盖512x512以上的像素，多个光栅化线程会同时第一次写入同一个tile，
+  //物化tile的时候互相覆盖。它们都很小，直接写满
+  const Range range(value, value);
+  _block.ForEach([&](uint32_t, uint32_t, Range& block) { block = range; });
+  _coarse.ForEach([&](uint32_t, uint32_t, Range& coarse) { coarse = range; });
+  _isCoarseDirty.ForEach([](uint32_t, uint32_t, uint8_t& isDirty) { isDirty = 0; });
+}
+
+template <class T>
+void HiZBuffer::Build(const Buffer2d<T>& depth) noexcept {
+  for (uint32_t bx = 0; bx < _block.GetWidth(); bx++) {
+    for (uint32_t by = 0; by < _block.GetHeight(); by++) {
+      UpdateBlock(depth, bx, by);
+    }
+  }
+}
+
+template <class T>
+void HiZBuffer::UpdateBlock(const Buffer2d<T>& depth, uint32_t bx, uint32_t by) noexcept {
+  uint32_t x0 = bx * BLOCK_SIZE, x1 = std::min(x0 + BLOCK_SIZE, _width);
+  uint32_t y0 = by * BLOCK_SIZE, y1 = std::min(y0 + BLOCK_SIZE, _height);
+  T minValue = depth(x0, y0), maxValue = depth(x0, y0);
+  //待清除的tile里没有实际的内存可以读，块总在一个tile内
+  if (!depth.IsPendingClear(x0, y0)) {
+    for (uint32_t x = x0; x < x1; x++) {
+      const T* column = &depth(x, y0);
+      for (uint32_t j = 0; j < y1 - y0; j++) {
+        minValue = std::min(minValue, column[j]);
+        maxValue = std::max(maxValue, column[j]);
+      }
+    }
+  }
+  _block(bx, by) = Range(DepthFormat<T>::Decode(minValue) - DepthFormat<T>::QUANTUM,
+                         DepthFormat<T>::Decode(maxValue) + DepthFormat<T>::QUANTUM);
+  _isCoarseDirty(bx * BLOCK_SIZE / COARSE_SIZE, by * BLOCK_SIZE / COARSE_SIZE) = 1;
+}
+
+template <class T>
+void HiZBuffer::Expand(uint32_t x, uint32_t y, T value) noexcept {
+  float minDepth = DepthFormat<T>::Decode(value) - DepthFormat<T>::QUANTUM;
+  float maxDepth = DepthFormat<T>::Decode(value) + DepthFormat<T>::QUANTUM;
+  Range& block = _block(x / BLOCK_SIZE, y / BLOCK_SIZE);
+  block = Range(std::min(block[0], minDepth), std::max(block[1], maxDepth));
+  Range& coarse = _coarse(x / COARSE_SIZE, y / COARSE_SIZE);
+  coarse = Range(std::min(coarse[0], minDepth), std::max(coarse[1], maxDepth));
+}
+
+template void HiZBuffer::Build(const Buffer2d<float>&) noexcept;
+template void HiZBuffer::Build(const Buffer2d<uint16_t>&) noexcept;
+template void HiZBuffer::Build(const Buffer2d<uint32_t>&) noexcept;
+template void HiZBuffer::UpdateBlock(const Buffer2d<float>&, uint32_t, uint32_t) noexcept;
+template void HiZBuffer::UpdateBlock(const Buffer2d<uint16_t>&, uint32_t, uint32_t) noexcept;
+template void HiZBuffer::UpdateBlock(const Buffer2d<uint32_t>&, uint32_t, uint32_t) noexcept;
+template void HiZBuffer::Expand(uint32_t, uint32_t, float) noexcept;
+template void HiZBuffer::Expand(uint32_t, uint32_t, uint16_t) noexcept;
+template void HiZBuffer::Expand(uint32_t, uint32_t, uint32_t) noexcept;
+
+const HiZBuffer::Range& HiZBuffer::GetCoarse(uint32_t cx, uint32_t cy) noexcept {
+  if (_isCoarseDirty(cx, cy)) {
+    constexpr uint32_t ratio = COARSE_SIZE / BLOCK_SIZE;
+    uint32_t bx0 = cx * ratio, bx1 = std::min(bx0 + ratio, _block.GetWidth());
+    uint32_t by0 = cy * ratio, by1 = std::min(by0 + ratio, _block.GetHeight());
+    Range range = _block(bx0, by0);
+    for (uint32_t bx = bx0; bx < bx1; bx++) {
+      for (uint32_t by = by0; by < by1; by++) {
+        range = Range(std::min(range[0], _block(bx, by)[0]), std::max(range[1], _block(bx, by)[1]));
+      }
+    }
+    _coarse(cx, cy) = range;
+    _isCoarseDirty(cx, cy) = 0;
+  }
+  return _coarse(cx, cy);
+}
+
+MultisampleBuffer::MultisampleBuffer(uint32_t width, uint32_t height, uint32_t sampleCount, const BufferOptions& options)
+    : _width(width),
+      _height(height),
+      _sampleCount(sampleCount),
+      _isUniform(width, height, BufferOptions{options.Layout}) {  //初始都不压缩，和每个采样的初始内容一致
+  assert(sampleCount == 4 || sampleCount == 8);
+  _depth.reserve(sampleCount);
+  _color.reserve(sampleCount);
+  for (uint32_t i = 0; i < sampleCount; i++) {
+    _depth.emplace_back(width, height, options);
+    _color.emplace_back(width, height, options);
+  }
+}
+
+void MultisampleBuffer::Fill(const Color4f& color, float depth) noexcept {
+  for (Buffer2d<float>& d : _depth) {
+    d.Fill(depth);
+  }
+  _color[0].Fill(color);
+  _isUniform.Fill(1);
+}
@@ -79,3 +79,95 @@ uint32_t Color4b::ToInt32RGBA() const noexcept {
   uint32_t a = A();
   return (b << 16) | (g << 8) | r | (a << 24);
 }
+
+//sRGB的8位编码和线性值之间的查找表
+//编码时先按线性值所在的1/4096区间查出区间起点的编码值，再和阈值比较，最多进一位
+struct SrgbTable {
+  float Decode[256];  //编码值 -> 线性值
+  SrgbEncodeTable Encode;
+};
+static const SrgbTable& GetSrgbTable() noexcept {
+  static const SrgbTable table = []() {
+    auto toLinear = [](double c) {
+      return c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+    };
+    SrgbTable t;
+    for (int i = 0; i < 256; i++) {
+      t.Decode[i] = (float)toLinear(i / 255.0);
+    }
+    for (int i = 0; i < 255; i++) {
+      //取不小于精确分界值的最小float，这样float的线性值和它比较就等于和精确值比较
+      double threshold = toLinear((i + 0.5) / 255.0);
+      float f = (float)threshold;
+      t.Encode.Threshold[i] = (double)f < threshold ? std::nextafter(f, 2.0f) : f;
+    }
+    t.Encode.Threshold[255] = 2.0f;
+    for (int b = 0; b < SRGB_BUCKET_COUNT; b++) {
+      float start = (float)b / SRGB_BUCKET_COUNT;
+      t.Encode.Bucket[b] = (uint8_t)(std::upper_bound(t.Encode.Threshold, t.Encode.Threshold + 255, start) - t.Encode.Threshold);
+    }
+    return t;
+  }();
+  return table;
+}
+static uint32_t EncodeUnorm(float value, float maxValue) noexcept {
+  return (uint32_t)(std::clamp(value, 0.0f, 1.0f) * maxValue + 0.5f);
+}
+uint8_t hackri::EncodeSrgb8(float linear) noexcept {
+  if (!(linear > 0.0f)) {
+    return 0;
+  }
+  if (linear >= 1.0f) {
+    return 255;
+  }
+  const SrgbEncodeTable& table = GetSrgbEncodeTable();
+  uint32_t code = table.Bucket[(int)(linear * SRGB_BUCKET_COUNT)];
+  return (uint8_t)(code + (linear >= table.Threshold[code] ? 1 : 0));
+}
+const SrgbEncodeTable& hackri::GetSrgbEncodeTable() noexcept {
+  return GetSrgbTable().Encode;
+}
+
+uint32_t hackri::PackColor(const Color4f& color, ColorFormat format) noexcept {
+  switch (format) {
+    case ColorFormat::RGBA8Unorm:
+      return EncodeUnorm(color.R(), 255.0f) |
+             (EncodeUnorm(color.G(), 255.0f) << 8) |
+             (EncodeUnorm(color.B(), 255.0f) << 16) |
+             (EncodeUnorm(color.A(), 255.0f) << 24);
+    case ColorFormat::RGBA8Srgb:
+      return uint32_t(EncodeSrgb8(color.R())) |
+             (uint32_t(EncodeSrgb8(color.G())) << 8) |
+             (uint32_t(EncodeSrgb8(color.B())) << 16) |
+             (EncodeUnorm(color.A(), 255.0f) << 24);
+    case ColorFormat::RGB10A2Unorm:
+      return EncodeUnorm(color.R(), 1023.0f) |
+             (EncodeUnorm(color.G(), 1023.0f) << 10) |
+             (EncodeUnorm(color.B(), 1023.0f) << 20) |
+             (EncodeUnorm(color.A(), 3.0f) << 30);
+  }
+  return 0;
+}
+
+Color4f hackri::UnpackColor(uint32_t packed, ColorFormat format) noexcept {
+  switch (format) {
+    case ColorFormat::RGBA8Unorm:
+      return Color4f((packed & 0xff) * (1.0f / 255.0f),
+                     ((packed >> 8) & 0xff) * (1.0f / 255.0f),
+                     ((packed >> 16) & 0xff) * (1.0f / 255.0f),
+                     (packed >> 24) * (1.0f / 255.0f));
+    case ColorFormat::RGBA8Srgb: {
+      const SrgbTable& table = GetSrgbTable();
+      return Color4f(table.Decode[packed & 0xff],
+                     table.Decode[(packed >> 8) & 0xff],
+                     table.Decode[(packed >> 16) & 0xff],
+                     (packed >> 24) * (1.0f / 255.0f));
+    }
+    case ColorFormat::RGB10A2Unorm:
+      return Color4f((packed & 0x3ff) * (1.0f / 1023.0f),
+                     ((packed >> 10) & 0x3ff) * (1.0f / 1023.0f),
+                     ((packed >> 20) & 0x3ff) * (1.0f / 1023.0f),
+                     (packed >> 30) * (1.0f / 3.0f));
+  }
+  return Color4f(0.0f);
+}
@@ -0,0 +1,237 @@
+#include <hackri/renderer.h>
+#include <hackri/simd.h>
+
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+
+using namespace hackri;
+
+//FXAA本来在gamma空间的颜色上计算亮度，颜色缓冲是线性的，用sqrt近似一下
+static float ComputeLuma(const Color4f& color) noexcept {
+  return std::sqrt(std::max(0.0f, 0.299f * color.R() + 0.587f * color.G() + 0.114f * color.B()));
+}
+//整张图的亮度，四周多一圈复制边缘像素的边框，按列存储
+//边缘检测读上下左右的邻居时不需要判断边界
+struct LumaImage {
+  float* Data;        //从PipelineMemory::Arena分配
+  int Width, Height;  //不含边框
+  size_t Pitch;       //一列的长度，包括上下边框
+
+  float* Column(int x) noexcept { return Data + size_t(x + 1) * Pitch + 1; }
+  const float* Column(int x) const noexcept { return Data + size_t(x + 1) * Pitch + 1; }
+  //超出图像的坐标取最近的边缘像素
+  float At(int x, int y) const noexcept {
+    return Column(std::clamp(x, 0, Width - 1))[std::clamp(y, 0, Height - 1)];
+  }
+  //像素中心在整数坐标上的双线性采样
+  float Sample(float x, float y) const noexcept {
+    const float fx = std::floor(x), fy = std::floor(y);
+    const float tx = x - fx, ty = y - fy;
+    const int ix = (int)fx, iy = (int)fy;
+    const float a = At(ix, iy) + (At(ix + 1, iy) - At(ix, iy)) * tx;
+    const float b = At(ix, iy + 1) + (At(ix + 1, iy + 1) - At(ix, iy + 1)) * tx;
+    return a + (b - a) * ty;
+  }
+};
+static Color4f SampleColor(const Buffer2d<Color4f>& source, float x, float y) noexcept {
+  const int w = (int)source.GetWidth(), h = (int)source.GetHeight();
+  const float fx = std::floor(x), fy = std::floor(y);
+  const float tx = x - fx, ty = y - fy;
+  auto at = [&](int i, int j) -> const Color4f& {
+    return source((uint32_t)std::clamp(i, 0, w - 1), (uint32_t)std::clamp(j, 0, h - 1));
+  };
+  const int ix = (int)fx, iy = (int)fy;
+  const Color4f a = at(ix, iy) + (at(ix + 1, iy) - at(ix, iy)) * tx;
+  const Color4f b = at(ix, iy + 1) + (at(ix + 1, iy + 1) - at(ix, iy + 1)) * tx;
+  return a + (b - a) * ty;
+}
+//连续count个像素的亮度
+static void ComputeLumaRun(const Color4f* src, size_t count, float* result) noexcept {
+  size_t i = 0;
+#if defined(HACKRI_SIMD_X86)
+  //4个像素转置成R、G、B三个寄存器，一次算4个
+  const __m128 wr = _mm_set1_ps(0.299f), wg = _mm_set1_ps(0.587f), wb = _mm_set1_ps(0.114f);
+  for (; i + 4 <= count; i += 4) {
+    __m128 r = _mm_loadu_ps(reinterpret_cast<const float*>(src + i));
+    __m128 g = _mm_loadu_ps(reinterpret_cast<const float*>(src + i + 1));
+    __m128 b = _mm_loadu_ps(reinterpret_cast<const float*>(src + i + 2));
+    __m128 a = _mm_loadu_ps(reinterpret_cast<const float*>(src + i + 3));
+    _MM_TRANSPOSE4_PS(r, g, b, a);
+    __m128 luma = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, wr), _mm_mul_ps(g, wg)), _mm_mul_ps(b, wb));
+    _mm_storeu_ps(result + i, _mm_sqrt_ps(_mm_max_ps(luma, _mm_setzero_ps())));
+  }
+#endif
+  for (; i < count; i++) {
+    result[i] = ComputeLuma(src[i]);
+  }
+}
+//FXAA 3.11的搜索步长，越远步子越大
+constexpr float FXAA_SEARCH_STEPS[] = {1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.5f, 2.0f, 2.0f, 2.0f, 2.0f, 4.0f, 8.0f};
+//边缘上的像素，返回混合用的采样位置（像素中心在整数坐标上）
+//先判断边缘是横向还是纵向，沿边缘两头搜索到端点，按离端点的距离决定往边缘另一侧偏移多少，
+//再和子像素走样（比边缘细的高频细节）的偏移取较大的一个
+static Vector2f FindBlendPosition(
+    const LumaImage& luma, int x, int y,
+    float lumaC, float lumaD, float lumaU, float lumaL, float lumaR, float range,
+    const FXAAOptions& options) noexcept {
+  const float lumaDL = luma.At(x - 1, y - 1), lumaUR = luma.At(x + 1, y + 1);
+  const float lumaUL = luma.At(x - 1, y + 1), lumaDR = luma.At(x + 1, y - 1);
+  const float lumaDU = lumaD + lumaU, lumaLR = lumaL + lumaR;
+  const float lumaLeftCorners = lumaDL + lumaUL, lumaDownCorners = lumaDL + lumaDR;
+  const float lumaRightCorners = lumaDR + lumaUR, lumaUpCorners = lumaUR + lumaUL;
+  const float edgeHorizontal = std::abs(-2.0f * lumaL + lumaLeftCorners) +
+                               std::abs(-2.0f * lumaC + lumaDU) * 2.0f +
+                               std::abs(-2.0f * lumaR + lumaRightCorners);
+  const float edgeVertical = std::abs(-2.0f * lumaU + lumaUpCorners) +
+                             std::abs(-2.0f * lumaC + lumaLR) * 2.0f +
+                             std::abs(-2.0f * lumaD + lumaDownCorners);
+  const bool isHorizontal = edgeHorizontal >= edgeVertical;
+  //边缘两侧的像素，选梯度大的一侧
+  const float luma1 = isHorizontal ? lumaD : lumaL;
+  const float luma2 = isHorizontal ? lumaU : lumaR;
+  const float gradient1 = luma1 - lumaC, gradient2 = luma2 - lumaC;
+  const bool is1Steepest = std::abs(gradient1) >= std::abs(gradient2);
+  const float gradientScaled = 0.25f * std::max(std::abs(gradient1), std::abs(gradient2));
+  const float stepLength = is1Steepest ? -1.0f : 1.0f;
+  const float lumaLocalAverage = 0.5f * ((is1Steepest ? luma1 : luma2) + lumaC);
+  //从两个像素之间的边缘线上出发，沿边缘往两头搜索亮度变化超过梯度的位置
+  float baseX = (float)x, baseY = (float)y;
+  (isHorizontal ? baseY : baseX) += 0.5f * stepLength;
+  const float offsetX = isHorizontal ? 1.0f : 0.0f, offsetY = isHorizontal ? 0.0f : 1.0f;
+  float x1 = baseX - offsetX, y1 = baseY - offsetY;
+  float x2 = baseX + offsetX, y2 = baseY + offsetY;
+  float lumaEnd1 = luma.Sample(x1, y1) - lumaLocalAverage;
+  float lumaEnd2 = luma.Sample(x2, y2) - lumaLocalAverage;
+  bool isReached1 = std::abs(lumaEnd1) >= gradientScaled;
+  bool isReached2 = std::abs(lumaEnd2) >= gradientScaled;
+  for (size_t i = 1; i < std::size(FXAA_SEARCH_STEPS) && !(isReached1 && isReached2); i++) {
+    const float step = FXAA_SEARCH_STEPS[i];
+    if (!isReached1) {
+      x1 -= offsetX * step, y1 -= offsetY * step;
+      lumaEnd1 = luma.Sample(x1, y1) - lumaLocalAverage;
+      isReached1 = std::abs(lumaEnd1) >= gradientScaled;
+    }
+    if (!isReached2) {
+      x2 += offsetX * step, y2 += offsetY * step;
+      lumaEnd2 = luma.Sample(x2, y2) - lumaLocalAverage;
+      isReached2 = std::abs(lumaEnd2) >= gradientScaled;
+    }
+  }
+  const float distance1 = isHorizontal ? (float)x - x1 : (float)y - y1;
+  const float distance2 = isHorizontal ? x2 - (float)x : y2 - (float)y;
+  const bool isDirection1 = distance1 < distance2;
+  const float distanceFinal = std::min(distance1, distance2);
+  const float edgeThickness = distance1 + distance2;
+  //离近的端点越近偏移越大。端点处的亮度变化方向要和中心像素一致，否则这个像素不在边缘的阶梯上
+  const bool isLumaCenterSmaller = lumaC < lumaLocalAverage;
+  const bool isCorrectVariation = ((isDirection1 ? lumaEnd1 : lumaEnd2) < 0.0f) != isLumaCenterSmaller;
+  float finalOffset = isCorrectVariation ? 0.5f - distanceFinal / edgeThickness : 0.0f;
+  //子像素走样，3x3邻域的加权平均和中心差得越多偏移越大
+  const float lumaAverage = (1.0f / 12.0f) * (2.0f * (lumaDU + lumaLR) + lumaLeftCorners + lumaRightCorners);
+  const float subPixelOffset1 = std::clamp(std::abs(lumaAverage - lumaC) / range, 0.0f, 1.0f);
+  const float subPixelOffset2 = (-2.0f * subPixelOffset1 + 3.0f) * subPixelOffset1 * subPixelOffset1;
+  finalOffset = std::max(finalOffset, subPixelOffset2 * subPixelOffset2 * options.SubpixelQuality);
+  return isHorizontal ? Vector2f((float)x, (float)y + finalOffset * stepLength)
+                      : Vector2f((float)x + finalOffset * stepLength, (float)y);
+}
+
+void Renderer::ApplyFXAA(
+    const Buffer2d<Color4f>& source, Buffer2d<Color4f>& target,
+    PipelineMemory& memory,
+    const FXAAOptions& options) {
+  assert(&source != &target);
+  assert(source.GetWidth() == target.GetWidth() && source.GetHeight() == target.GetHeight());
+  ThreadPool* workers = memory.Workers;
+  constexpr uint32_t tileSize = Buffer2d<Color4f>::LAYOUT_TILE_SIZE;
+  constexpr uint32_t blockSize = Buffer2d<Color4f>::LAYOUT_BLOCK_SIZE;
+  const uint32_t width = source.GetWidth(), height = source.GetHeight();
+  const uint32_t tileCountX = (width + tileSize - 1) / tileSize;
+  const uint32_t tileCountY = (height + tileSize - 1) / tileSize;
+  auto run = [&](size_t count, const ThreadPool::Task& task) -> void {
+    if (workers == nullptr) {
+      for (size_t i = 0; i < count; i++) {
+        task(i, 0);
+      }
+    } else {
+      workers->ParallelFor(count, task);
+    }
+  };
+  //第一步：每64列一个任务算出亮度
+  LumaImage luma;
+  luma.Width = (int)width;
+  luma.Height = (int)height;
+  luma.Pitch = size_t(height) + 2;
+  luma.Data = memory.Allocate<float>(luma.Pitch * (size_t(width) + 2));  //每个元素都会写入，不用初始化
+  run(tileCountX, [&](size_t strip, size_t) {
+    const uint32_t x0 = uint32_t(strip) * tileSize, x1 = std::min(x0 + tileSize, width);
+    for (uint32_t x = x0; x < x1; x++) {
+      float* column = luma.Column((int)x);
+      for (uint32_t by = 0; by < height; by += blockSize) {
+        const uint32_t count = std::min(blockSize, height - by);
+        if (source.IsPendingClear(x, by)) {
+          std::fill(column + by, column + by + count, ComputeLuma(source.GetClearValue()));
+        } else {
+          ComputeLumaRun(&source(x, by), count, column + by);  //8x8对齐的块里一列是连续的
+        }
+      }
+      column[-1] = column[0];
+      column[height] = column[height - 1];
+    }
+  });
+  std::copy_n(luma.Column(0) - 1, luma.Pitch, luma.Column(-1) - 1);
+  std::copy_n(luma.Column((int)width - 1) - 1, luma.Pitch, luma.Column((int)width) - 1);
+  //第二步：按tile找出局部对比度够大的像素，沿边缘搜索并混合后写进target，其他像素原样复制
+  //一次处理8x8对齐的块里的一列，大部分像素都不是边缘，只要复制一段连续的颜色
+  //source和target不是同一个缓冲，每个tile只写target里自己的像素，不需要先存下结果
+  const size_t tileCount = size_t(tileCountX) * tileCountY;
+  run(tileCount, [&](size_t tile, size_t) {
+    const uint32_t x0 = uint32_t(tile / tileCountY) * tileSize, y0 = uint32_t(tile % tileCountY) * tileSize;
+    const uint32_t x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+    for (uint32_t x = x0; x < x1; x++) {
+      const float* left = luma.Column((int)x - 1);
+      const float* center = luma.Column((int)x);
+      const float* right = luma.Column((int)x + 1);
+      for (uint32_t by = y0; by < y1; by += blockSize) {
+        const uint32_t count = std::min(blockSize, y1 - by);
+        uint32_t edgeMask = 0;
+        uint32_t j = 0;
+#if defined(HACKRI_SIMD_X86)
+        const __m128 thresholdMin = _mm_set1_ps(options.EdgeThresholdMin);
+        const __m128 threshold = _mm_set1_ps(options.EdgeThreshold);
+        for (; j + 4 <= count; j += 4) {
+          const uint32_t y = by + j;
+          const __m128 c = _mm_loadu_ps(center + y);
+          const __m128 d = _mm_loadu_ps(center + y - 1);
+          const __m128 u = _mm_loadu_ps(center + y + 1);
+          const __m128 l = _mm_loadu_ps(left + y);
+          const __m128 r = _mm_loadu_ps(right + y);
+          const __m128 lumaMin = _mm_min_ps(_mm_min_ps(_mm_min_ps(c, d), _mm_min_ps(u, l)), r);
+          const __m128 lumaMax = _mm_max_ps(_mm_max_ps(_mm_max_ps(c, d), _mm_max_ps(u, l)), r);
+          const __m128 limit = _mm_max_ps(thresholdMin, _mm_mul_ps(lumaMax, threshold));
+          edgeMask |= uint32_t(_mm_movemask_ps(_mm_cmpge_ps(_mm_sub_ps(lumaMax, lumaMin), limit))) << j;
+        }
+#endif
+        for (; j < count; j++) {
+          const uint32_t y = by + j;
+          const float lumaMin = std::min({center[y], center[y - 1], center[y + 1], left[y], right[y]});
+          const float lumaMax = std::max({center[y], center[y - 1], center[y + 1], left[y], right[y]});
+          edgeMask |= lumaMax - lumaMin >= std::max(options.EdgeThresholdMin, lumaMax * options.EdgeThreshold) ? 1u << j : 0u;
+        }
+        Color4f* output = &target(x, by);  //8x8对齐的块里一列是连续的
+        if (source.IsPendingClear(x, by)) {
+          std::fill(output, output + count, source.GetClearValue());
+        } else {
+          std::copy_n(&source(x, by), count, output);
+        }
+        for (; edgeMask != 0; edgeMask &= edgeMask - 1) {
+          const uint32_t y = by + CountTrailingZero(edgeMask);
+          const float lumaC = center[y], lumaD = center[y - 1], lumaU = center[y + 1], lumaL = left[y], lumaR = right[y];
+          const float range = std::max({lumaC, lumaD, lumaU, lumaL, lumaR}) - std::min({lumaC, lumaD, lumaU, lumaL, lumaR});
+          Vector2f position = FindBlendPosition(luma, (int)x, (int)y, lumaC, lumaD, lumaU, lumaL, lumaR, range, options);
+          output[y - by] = SampleColor(source, position.X(), position.Y());
+        }
+      }
+    }
+  });
+}
@@ -1,6 +1,7 @@
 #include <hackri/image.h>
 
 #include <cstdio>
+#include <cstring>
 #include <cstdlib>
 #include <string>
 #include <stdexcept>
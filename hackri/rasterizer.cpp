@@ -0,0 +1,443 @@
+#include <hackri/rasterizer.h>
+#include <hackri/simd.h>
+
+#include <algorithm>
+#include <type_traits>
+
+using namespace hackri;
+
+//8条lane的边函数用int32计算：块内每列的起点先用int64算好再截断到±2^30
+//只要7 * |StepY| < 2^30（三角形设置时保证），截断不会改变任何lane的符号
+constexpr int64_t LANE_CLAMP = int64_t(1) << 30;
+static int32_t ClampEdge(int64_t e) noexcept {
+  return (int32_t)std::clamp(e, -LANE_CLAMP, LANE_CLAMP);
+}
+//块内哪些行在rect里
+static uint32_t RowBits(uint32_t y0, const Array<uint32_t, 4>& rect) noexcept {
+  uint32_t bits = 0;
+  for (uint32_t j = 0; j < BLOCK_SIZE; j++) {
+    uint32_t y = y0 + j;
+    if (y >= rect[1] && y <= rect[3]) {
+      bits |= 1u << j;
+    }
+  }
+  return bits;
+}
+//逐像素深度测试并写入，用于标量实现和超出缓冲区高度的不完整的列
+//定点格式先量化再和存储值比较，存储值都能用float精确表示
+template <TestComparison Test, class T>
+static uint32_t TestColumnScalar(const float* depth, T* target, uint32_t bits) noexcept {
+  for (uint32_t j = 0; j < BLOCK_SIZE; j++) {
+    if ((bits & (1u << j)) == 0) {
+      continue;
+    }
+    T value = DepthFormat<T>::Encode(depth[j]);
+    if (TestImpl((float)value, (float)target[j], Test)) {
+      target[j] = value;
+    } else {
+      bits &= ~(1u << j);
+    }
+  }
+  return bits;
+}
+template <TestComparison Test, class T>
+static void BlockCoverageScalar(
+    const TriangleSetup& tri,
+    uint32_t x0, uint32_t y0,
+    const Array<uint32_t, 4>& rect,
+    Buffer2d<T>* depthBuffer,
+    BlockCoverage& result) {
+  result.Mask = 0;
+  const uint32_t rowBits = RowBits(y0, rect);
+  if (rowBits == 0) {
+    return;
+  }
+  const int64_t px = int64_t(x0) * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2;
+  const int64_t py = int64_t(y0) * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2;
+  int64_t colE0 = tri.Edge[0].Evaluate(px, py);
+  int64_t colE1 = tri.Edge[1].Evaluate(px, py);
+  int64_t colE2 = tri.Edge[2].Evaluate(px, py);
+  for (uint32_t i = 0; i < BLOCK_SIZE; i++,
+                colE0 += tri.Edge[0].StepX(), colE1 += tri.Edge[1].StepX(), colE2 += tri.Edge[2].StepX()) {
+    uint32_t x = x0 + i;
+    if (x < rect[0] || x > rect[2]) {
+      continue;
+    }
+    uint32_t bits = 0;
+    int64_t e0 = colE0, e1 = colE1, e2 = colE2;
+    for (uint32_t j = 0; j < BLOCK_SIZE; j++,
+                  e0 += tri.Edge[0].StepY(), e1 += tri.Edge[1].StepY(), e2 += tri.Edge[2].StepY()) {
+      if ((rowBits & (1u << j)) != 0 && (e0 | e1 | e2) >= 0) {
+        bits |= 1u << j;
+        result.Depth[i * BLOCK_SIZE + j] = tri.DepthAt(x, y0 + j);
+      }
+    }
+    if (bits != 0 && depthBuffer != nullptr) {
+      bits = TestColumnScalar<Test>(result.Depth + i * BLOCK_SIZE, &(*depthBuffer)(x, y0), bits);
+    }
+    result.Mask |= uint64_t(bits) << (i * BLOCK_SIZE);
+  }
+}
+#if defined(HACKRI_SIMD_X86)
+//#######
+//# SSE2 #
+//#######
+template <TestComparison Test>
+static __m128 CompareDepthSse(__m128 depth, __m128 target) noexcept {
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  switch (Test) {
+    case TestComparison::Never:
+      return _mm_setzero_ps();
+    case TestComparison::Less:
+      return _mm_cmplt_ps(depth, target);
+    case TestComparison::Equal:
+      return _mm_cmple_ps(_mm_and_ps(_mm_sub_ps(depth, target), absMask), _mm_set1_ps(float(1e-5)));
+    case TestComparison::LessEqual:
+      return _mm_cmple_ps(depth, target);
+    case TestComparison::Greater:
+      return _mm_cmpgt_ps(depth, target);
+    case TestComparison::NotEqual:
+      return _mm_cmpgt_ps(_mm_and_ps(_mm_sub_ps(depth, target), absMask), _mm_set1_ps(float(1e-5)));
+    case TestComparison::GreaterEqual:
+      return _mm_cmpge_ps(depth, target);
+    case TestComparison::Always:
+      return _mm_castsi128_ps(_mm_set1_epi32(-1));
+    default:
+      return _mm_setzero_ps();
+  }
+}
+//定点深度的存储值不超过24位，用有符号的int32比较就行
+template <TestComparison Test>
+static __m128i CompareDepthIntSse(__m128i value, __m128i target) noexcept {
+  const __m128i ones = _mm_set1_epi32(-1);
+  switch (Test) {
+    case TestComparison::Never:
+      return _mm_setzero_si128();
+    case TestComparison::Less:
+      return _mm_cmplt_epi32(value, target);
+    case TestComparison::Equal:
+      return _mm_cmpeq_epi32(value, target);
+    case TestComparison::LessEqual:
+      return _mm_xor_si128(_mm_cmpgt_epi32(value, target), ones);
+    case TestComparison::Greater:
+      return _mm_cmpgt_epi32(value, target);
+    case TestComparison::NotEqual:
+      return _mm_xor_si128(_mm_cmpeq_epi32(value, target), ones);
+    case TestComparison::GreaterEqual:
+      return _mm_xor_si128(_mm_cmplt_epi32(value, target), ones);
+    case TestComparison::Always:
+      return ones;
+    default:
+      return _mm_setzero_si128();
+  }
+}
+static __m128 LaneMaskSse(uint32_t bits) noexcept {
+  const __m128i laneBit = _mm_setr_epi32(1, 2, 4, 8);
+  __m128i v = _mm_and_si128(_mm_set1_epi32((int)bits), laneBit);
+  return _mm_castsi128_ps(_mm_cmpeq_epi32(v, laneBit));
+}
+//和DepthFormat::Encode一致：钳制到[0, 1]，乘上最大值后按当前舍入模式（最近偶数）取整
+static __m128i EncodeDepthSse(__m128 depth, __m128 maxValue) noexcept {
+  __m128 clamped = _mm_min_ps(_mm_max_ps(depth, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+  return _mm_cvtps_epi32(_mm_mul_ps(clamped, maxValue));
+}
+static void LoadDepthSse(const uint16_t* target, __m128i& lo, __m128i& hi) noexcept {
+  __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target));
+  lo = _mm_unpacklo_epi16(packed, _mm_setzero_si128());
+  hi = _mm_unpackhi_epi16(packed, _mm_setzero_si128());
+}
+static void LoadDepthSse(const uint32_t* target, __m128i& lo, __m128i& hi) noexcept {
+  lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target));
+  hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target + 4));
+}
+static void StoreDepthSse(uint16_t* target, __m128i lo, __m128i hi) noexcept {
+  //SSE2没有无符号饱和打包，先平移到有符号范围打包，再把最高位翻回来
+  const __m128i bias = _mm_set1_epi32(0x8000);
+  __m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(target), _mm_xor_si128(packed, _mm_set1_epi16(-0x8000)));
+}
+static void StoreDepthSse(uint32_t* target, __m128i lo, __m128i hi) noexcept {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(target), lo);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(target + 4), hi);
+}
+//一整列8个像素的深度测试并写入，返回通过测试的像素
+template <TestComparison Test, class T>
+static uint32_t TestColumnSse(__m128 depthLo, __m128 depthHi, T* target, uint32_t bits) noexcept {
+  if constexpr (std::is_same_v<T, float>) {
+    __m128 targetLo = _mm_loadu_ps(target);
+    __m128 targetHi = _mm_loadu_ps(target + 4);
+    uint32_t pass = (uint32_t)_mm_movemask_ps(CompareDepthSse<Test>(depthLo, targetLo)) |
+                    ((uint32_t)_mm_movemask_ps(CompareDepthSse<Test>(depthHi, targetHi)) << 4);
+    bits &= pass;
+    if (bits != 0) {
+      __m128 writeLo = LaneMaskSse(bits);
+      __m128 writeHi = LaneMaskSse(bits >> 4);
+      _mm_storeu_ps(target, _mm_or_ps(_mm_and_ps(writeLo, depthLo), _mm_andnot_ps(writeLo, targetLo)));
+      _mm_storeu_ps(target + 4, _mm_or_ps(_mm_and_ps(writeHi, depthHi), _mm_andnot_ps(writeHi, targetHi)));
+    }
+  } else {
+    const __m128 maxValue = _mm_set1_ps(DepthFormat<T>::MAX_VALUE);
+    __m128i valueLo = EncodeDepthSse(depthLo, maxValue);
+    __m128i valueHi = EncodeDepthSse(depthHi, maxValue);
+    __m128i targetLo, targetHi;
+    LoadDepthSse(target, targetLo, targetHi);
+    uint32_t pass = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(CompareDepthIntSse<Test>(valueLo, targetLo))) |
+                    ((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(CompareDepthIntSse<Test>(valueHi, targetHi))) << 4);
+    bits &= pass;
+    if (bits != 0) {
+      __m128i writeLo = _mm_castps_si128(LaneMaskSse(bits));
+      __m128i writeHi = _mm_castps_si128(LaneMaskSse(bits >> 4));
+      StoreDepthSse(target,
+                    _mm_or_si128(_mm_and_si128(writeLo, valueLo), _mm_andnot_si128(writeLo, targetLo)),
+                    _mm_or_si128(_mm_and_si128(writeHi, valueHi), _mm_andnot_si128(writeHi, targetHi)));
+    }
+  }
+  return bits;
+}
+template <TestComparison Test, class T>
+static void BlockCoverageSse(
+    const TriangleSetup& tri,
+    uint32_t x0, uint32_t y0,
+    const Array<uint32_t, 4>& rect,
+    Buffer2d<T>* depthBuffer,
+    BlockCoverage& result) {
+  result.Mask = 0;
+  const uint32_t rowBits = RowBits(y0, rect);
+  if (rowBits == 0) {
+    return;
+  }
+  const int64_t px = int64_t(x0) * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2;
+  const int64_t py = int64_t(y0) * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2;
+  int64_t start[3];
+  __m128i laneStepLo[3], laneStepHi[3];
+  for (int k = 0; k < 3; k++) {
+    start[k] = tri.Edge[k].Evaluate(px, py);
+    int32_t s = (int32_t)tri.Edge[k].StepY();
+    laneStepLo[k] = _mm_setr_epi32(0, s, 2 * s, 3 * s);
+    laneStepHi[k] = _mm_setr_epi32(4 * s, 5 * s, 6 * s, 7 * s);
+  }
+  const __m128 originY = _mm_set1_ps(tri.PlaneOrigin.Y());
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 dzdy = _mm_set1_ps(tri.DepthPlane.Y());
+  __m128i rowLo = _mm_add_epi32(_mm_set1_epi32((int)y0), _mm_setr_epi32(0, 1, 2, 3));
+  __m128i rowHi = _mm_add_epi32(_mm_set1_epi32((int)y0), _mm_setr_epi32(4, 5, 6, 7));
+  const __m128 laneDepthLo = _mm_mul_ps(dzdy, _mm_sub_ps(_mm_add_ps(_mm_cvtepi32_ps(rowLo), half), originY));
+  const __m128 laneDepthHi = _mm_mul_ps(dzdy, _mm_sub_ps(_mm_add_ps(_mm_cvtepi32_ps(rowHi), half), originY));
+  const bool isFullColumn = depthBuffer != nullptr && y0 + BLOCK_SIZE <= depthBuffer->GetHeight();
+  for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+    uint32_t x = x0 + i;
+    if (x < rect[0] || x > rect[2]) {
+      continue;
+    }
+    __m128i orLo = _mm_setzero_si128(), orHi = _mm_setzero_si128();
+    for (int k = 0; k < 3; k++) {
+      __m128i colE = _mm_set1_epi32(ClampEdge(start[k] + tri.Edge[k].StepX() * i));
+      orLo = _mm_or_si128(orLo, _mm_add_epi32(colE, laneStepLo[k]));
+      orHi = _mm_or_si128(orHi, _mm_add_epi32(colE, laneStepHi[k]));
+    }
+    uint32_t signBits = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(orLo)) |
+                        ((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(orHi)) << 4);
+    uint32_t bits = ~signBits & rowBits;
+    if (bits == 0) {
+      continue;
+    }
+    float column = tri.DepthPlane.Z() + tri.DepthPlane.X() * ((float)x + 0.5f - tri.PlaneOrigin.X());
+    __m128 depthLo = _mm_add_ps(_mm_set1_ps(column), laneDepthLo);
+    __m128 depthHi = _mm_add_ps(_mm_set1_ps(column), laneDepthHi);
+    float* depth = result.Depth + i * BLOCK_SIZE;
+    _mm_storeu_ps(depth, depthLo);
+    _mm_storeu_ps(depth + 4, depthHi);
+    if (depthBuffer != nullptr) {
+      T* target = &(*depthBuffer)(x, y0);
+      if (isFullColumn) {
+        bits = TestColumnSse<Test>(depthLo, depthHi, target, bits);
+      } else {
+        bits = TestColumnScalar<Test>(depth, target, bits);
+      }
+    }
+    result.Mask |= uint64_t(bits) << (i * BLOCK_SIZE);
+  }
+}
+//#######
+//# AVX2 #
+//#######
+template <TestComparison Test>
+HACKRI_TARGET_AVX2 static __m256 CompareDepthAvx2(__m256 depth, __m256 target) noexcept {
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  switch (Test) {
+    case TestComparison::Never:
+      return _mm256_setzero_ps();
+    case TestComparison::Less:
+      return _mm256_cmp_ps(depth, target, _CMP_LT_OQ);
+    case TestComparison::Equal:
+      return _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(depth, target), absMask), _mm256_set1_ps(float(1e-5)), _CMP_LE_OQ);
+    case TestComparison::LessEqual:
+      return _mm256_cmp_ps(depth, target, _CMP_LE_OQ);
+    case TestComparison::Greater:
+      return _mm256_cmp_ps(depth, target, _CMP_GT_OQ);
+    case TestComparison::NotEqual:
+      return _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(depth, target), absMask), _mm256_set1_ps(float(1e-5)), _CMP_GT_OQ);
+    case TestComparison::GreaterEqual:
+      return _mm256_cmp_ps(depth, target, _CMP_GE_OQ);
+    case TestComparison::Always:
+      return _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    default:
+      return _mm256_setzero_ps();
+  }
+}
+template <TestComparison Test>
+HACKRI_TARGET_AVX2 static __m256i CompareDepthIntAvx2(__m256i value, __m256i target) noexcept {
+  const __m256i ones = _mm256_set1_epi32(-1);
+  switch (Test) {
+    case TestComparison::Never:
+      return _mm256_setzero_si256();
+    case TestComparison::Less:
+      return _mm256_cmpgt_epi32(target, value);
+    case TestComparison::Equal:
+      return _mm256_cmpeq_epi32(value, target);
+    case TestComparison::LessEqual:
+      return _mm256_xor_si256(_mm256_cmpgt_epi32(value, target), ones);
+    case TestComparison::Greater:
+      return _mm256_cmpgt_epi32(value, target);
+    case TestComparison::NotEqual:
+      return _mm256_xor_si256(_mm256_cmpeq_epi32(value, target), ones);
+    case TestComparison::GreaterEqual:
+      return _mm256_xor_si256(_mm256_cmpgt_epi32(target, value), ones);
+    case TestComparison::Always:
+      return ones;
+    default:
+      return _mm256_setzero_si256();
+  }
+}
+HACKRI_TARGET_AVX2 static __m256 LaneMaskAvx2(uint32_t bits) noexcept {
+  const __m256i laneBit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256i v = _mm256_and_si256(_mm256_set1_epi32((int)bits), laneBit);
+  return _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, laneBit));
+}
+HACKRI_TARGET_AVX2 static __m256i EncodeDepthAvx2(__m256 depth, __m256 maxValue) noexcept {
+  __m256 clamped = _mm256_min_ps(_mm256_max_ps(depth, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+  return _mm256_cvtps_epi32(_mm256_mul_ps(clamped, maxValue));
+}
+HACKRI_TARGET_AVX2 static __m256i LoadDepthAvx2(const uint16_t* target) noexcept {
+  return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(target)));
+}
+HACKRI_TARGET_AVX2 static __m256i LoadDepthAvx2(const uint32_t* target) noexcept {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(target));
+}
+HACKRI_TARGET_AVX2 static void StoreDepthAvx2(uint16_t* target, __m256i value) noexcept {
+  __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(target), packed);
+}
+HACKRI_TARGET_AVX2 static void StoreDepthAvx2(uint32_t* target, __m256i value) noexcept {
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(target), value);
+}
+template <TestComparison Test, class T>
+HACKRI_TARGET_AVX2 static uint32_t TestColumnAvx2(__m256 depth, T* target, uint32_t bits) noexcept {
+  if constexpr (std::is_same_v<T, float>) {
+    __m256 old = _mm256_loadu_ps(target);
+    bits &= (uint32_t)_mm256_movemask_ps(CompareDepthAvx2<Test>(depth, old));
+    if (bits != 0) {
+      _mm256_storeu_ps(target, _mm256_blendv_ps(old, depth, LaneMaskAvx2(bits)));
+    }
+  } else {
+    __m256i value = EncodeDepthAvx2(depth, _mm256_set1_ps(DepthFormat<T>::MAX_VALUE));
+    __m256i old = LoadDepthAvx2(target);
+    bits &= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(CompareDepthIntAvx2<Test>(value, old)));
+    if (bits != 0) {
+      StoreDepthAvx2(target, _mm256_blendv_epi8(old, value, _mm256_castps_si256(LaneMaskAvx2(bits))));
+    }
+  }
+  return bits;
+}
+template <TestComparison Test, class T>
+HACKRI_TARGET_AVX2 static void BlockCoverageAvx2(
+    const TriangleSetup& tri,
+    uint32_t x0, uint32_t y0,
+    const Array<uint32_t, 4>& rect,
+    Buffer2d<T>* depthBuffer,
+    BlockCoverage& result) {
+  result.Mask = 0;
+  const uint32_t rowBits = RowBits(y0, rect);
+  if (rowBits == 0) {
+    return;
+  }
+  const int64_t px = int64_t(x0) * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2;
+  const int64_t py = int64_t(y0) * SUBPIXEL_SCALE + SUBPIXEL_SCALE / 2;
+  const __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  int64_t start[3];
+  __m256i laneStep[3];
+  for (int k = 0; k < 3; k++) {
+    start[k] = tri.Edge[k].Evaluate(px, py);
+    laneStep[k] = _mm256_mullo_epi32(iota, _mm256_set1_epi32((int32_t)tri.Edge[k].StepY()));
+  }
+  __m256 row = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32((int)y0), iota));
+  row = _mm256_sub_ps(_mm256_add_ps(row, _mm256_set1_ps(0.5f)), _mm256_set1_ps(tri.PlaneOrigin.Y()));
+  const __m256 laneDepth = _mm256_mul_ps(_mm256_set1_ps(tri.DepthPlane.Y()), row);
+  const bool isFullColumn = depthBuffer != nullptr && y0 + BLOCK_SIZE <= depthBuffer->GetHeight();
+  for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+    uint32_t x = x0 + i;
+    if (x < rect[0] || x > rect[2]) {
+      continue;
+    }
+    __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(ClampEdge(start[0] + tri.Edge[0].StepX() * i)), laneStep[0]);
+    __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(ClampEdge(start[1] + tri.Edge[1].StepX() * i)), laneStep[1]);
+    __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(ClampEdge(start[2] + tri.Edge[2].StepX() * i)), laneStep[2]);
+    __m256i signs = _mm256_or_si256(_mm256_or_si256(e0, e1), e2);
+    uint32_t bits = ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(signs)) & rowBits;
+    if (bits == 0) {
+      continue;
+    }
+    float column = tri.DepthPlane.Z() + tri.DepthPlane.X() * ((float)x + 0.5f - tri.PlaneOrigin.X());
+    __m256 depth = _mm256_add_ps(_mm256_set1_ps(column), laneDepth);
+    _mm256_storeu_ps(result.Depth + i * BLOCK_SIZE, depth);
+    if (depthBuffer != nullptr) {
+      T* target = &(*depthBuffer)(x, y0);
+      if (isFullColumn) {
+        bits = TestColumnAvx2<Test>(depth, target, bits);
+      } else {
+        bits = TestColumnScalar<Test>(result.Depth + i * BLOCK_SIZE, target, bits);
+      }
+    }
+    result.Mask |= uint64_t(bits) << (i * BLOCK_SIZE);
+  }
+}
+#endif
+
+template <TestComparison Test, class T>
+static BlockCoverageFunc<T> SelectBlockCoverage(SimdLevel level) noexcept {
+  switch (level) {
+#if defined(HACKRI_SIMD_X86)
+    case SimdLevel::AVX2:
+      return BlockCoverageAvx2<Test, T>;
+    case SimdLevel::SSE2:
+      return BlockCoverageSse<Test, T>;
+#endif
+    default:
+      return BlockCoverageScalar<Test, T>;
+  }
+}
+template <class T>
+BlockCoverageFunc<T> hackri::GetBlockCoverageFunc(TestComparison test) noexcept {
+  const SimdLevel level = GetSimdLevel();
+  switch (test) {
+    case TestComparison::Never:
+      return SelectBlockCoverage<TestComparison::Never, T>(level);
+    case TestComparison::Less:
+      return SelectBlockCoverage<TestComparison::Less, T>(level);
+    case TestComparison::Equal:
+      return SelectBlockCoverage<TestComparison::Equal, T>(level);
+    case TestComparison::LessEqual:
+      return SelectBlockCoverage<TestComparison::LessEqual, T>(level);
+    case TestComparison::Greater:
+      return SelectBlockCoverage<TestComparison::Greater, T>(level);
+    case TestComparison::NotEqual:
+      return SelectBlockCoverage<TestComparison::NotEqual, T>(level);
+    case TestComparison::GreaterEqual:
+      return SelectBlockCoverage<TestComparison::GreaterEqual, T>(level);
+    default:
+      return SelectBlockCoverage<TestComparison::Always, T>(level);
+  }
+}
+template BlockCoverageFunc<float> hackri::GetBlockCoverageFunc<float>(TestComparison) noexcept;
+template BlockCoverageFunc<uint16_t> hackri::GetBlockCoverageFunc<uint16_t>(TestComparison) noexcept;
+template BlockCoverageFunc<uint32_t> hackri::GetBlockCoverageFunc<uint32_t>(TestComparison) noexcept;
@@ -1,6 +1,11 @@
 #include <hackri/renderer.h>
+#include <hackri/rasterizer.h>
+#include <hackri/pipeline.h>
+#include <hackri/simd.h>
 
 #include <cassert>
+#include <algorithm>
+#include <limits>
 
 using namespace hackri;
 //################
@@ -68,9 +73,6 @@ void Renderer::DrawLine(
 //###########
 //# 光栅管线 #
 //###########
-static int IsInClipSpace(const Vector4f& v) noexcept {
-  return std::abs(v.X()) <= v.W() && std::abs(v.Y()) <= v.W() && std::abs(v.Z()) <= v.W();
-}
 static Vector3f ViewportTransform(uint32_t width, uint32_t height, const Vector3f& ndc) noexcept {
   float x = (ndc.X() + 1) * 0.5f * (float)width;   // [-1, 1] -> [0, w]
   float y = (ndc.Y() + 1) * 0.5f * (float)height;  // [-1, 1] -> [0, h]
@@ -80,45 +82,35 @@ static Vector3f ViewportTransform(uint32_t width, uint32_t height, const Vector3
 static Array<uint32_t, 4> FindBoundingBox(const Span<Vector2f>& p, uint32_t width, uint32_t height) noexcept {
   Vector2f minConer = SelectMin(SelectMin(p[0], p[1]), p[2]);
   Vector2f maxConer = SelectMax(SelectMax(p[0], p[1]), p[2]);
-  Array<uint32_t, 4> bbox;
-  bbox[0] = (uint32_t)std::max((int)std::floor(minConer.X()), 0);
-  bbox[1] = (uint32_t)std::max((int)std::floor(minConer.Y()), 0);
-  bbox[2] = (uint32_t)std::min((int)std::ceil(maxConer.X()), (int)width - 1);
-  bbox[3] = (uint32_t)std::min((int)std::ceil(maxConer.Y()), (int)height - 1);
-  return bbox;
-}
-static bool IsSameSide(const Vector2f& pa, const Vector2f& pb, const Vector2f& a, const Vector2f& b) noexcept {
-  float e1 = Cross(b - a, pa - a);
-  float e2 = Cross(b - a, pb - a);
-  return (e1 * e2) >= 0;
-}
-static bool IsInTriangle(const Vector2f& p, const Vector2f* tri) noexcept {
-  return IsSameSide(p, tri[0], tri[1], tri[2]) &&
-         IsSameSide(p, tri[1], tri[0], tri[2]) &&
-         IsSameSide(p, tri[2], tri[0], tri[1]);
-}
-static Vector3f GetBaryCoord(const Vector2f& p, const Span<Vector2f>& tri) noexcept {
-  const Vector2f& a = tri[0];
-  const Vector2f& b = tri[1];
-  const Vector2f& c = tri[2];
-  Vector2f ab = b - a;
-  Vector2f ac = c - a;
-  Vector2f ap = p - a;
-  float factor = 1 / Cross(ab, ac);
-  float s = Cross(ap, ac) * factor;
-  float t = Cross(ab, ap) * factor;
-  return {1 - s - t, s, t};
+  int minX = std::max((int)std::floor(minConer.X()), 0);
+  int minY = std::max((int)std::floor(minConer.Y()), 0);
+  int maxX = std::min((int)std::ceil(maxConer.X()), (int)width - 1);
+  int maxY = std::min((int)std::ceil(maxConer.Y()), (int)height - 1);
+  //防护带内的三角形可能整个在视口外，返回min > max的空包围盒
+  if (minX > maxX || minY > maxY) {
+    return Array<uint32_t, 4>(1, 1, 0, 0);
+  }
+  return Array<uint32_t, 4>((uint32_t)minX, (uint32_t)minY, (uint32_t)maxX, (uint32_t)maxY);
 }
-static bool IsInTriangle(const Vector3f& bary) {
-  return bary.X() >= -EPSILON &&
-         bary.Y() >= -EPSILON &&
-         bary.Z() >= -EPSILON;
+//#################
+//# 定点数半平面光栅化 #
+//#################
+static int64_t ToSubpixel(float v) noexcept {
+  return (int64_t)std::lround(v * (float)SUBPIXEL_SCALE);
 }
-static float InterpolateDepth(const Vector3f& bary, const Span<float>& depth) {
-  float depth0 = depth[0] * bary.X();
-  float depth1 = depth[1] * bary.Y();
-  float depth2 = depth[2] * bary.Z();
-  return depth0 + depth1 + depth2;
+//有向边a->b，三角形内部在边的左侧（面积为正）
+//y轴朝上，所以向下走的边是左边，水平向x-走的边是上边
+//共享同一条边的两个三角形方向相反，top-left规则保证边上的像素只属于其中一个
+static EdgeFunction MakeEdge(int64_t ax, int64_t ay, int64_t bx, int64_t by) noexcept {
+  int64_t dx = bx - ax;
+  int64_t dy = by - ay;
+  bool isTopLeft = dy < 0 || (dy == 0 && dx < 0);
+  EdgeFunction e;
+  e.A = -dy;
+  e.B = dx;
+  e.Bias = isTopLeft ? 0 : -1;
+  e.C = dy * ax - dx * ay + e.Bias;
+  return e;
 }
 constexpr static void LerpProperties(
     float delta,
@@ -179,186 +171,193 @@ constexpr static float IntersectRatio(const Vector4f& prev, const Vector4f& curr
       return 0;
   }
 }
-static void SutherlandHodgemanAlgo(
+//裁剪后的多边形最多有3 + 7个顶点，凸多边形每被一个平面裁剪顶点数最多加1
+constexpr size_t MAX_CLIP_VERTEX = 3 + (size_t)ClipPlane::CLIP_SIZE;
+struct ClipVertex {
+  Vector4f Pos;
+  const float* Out;  //VS输出，指向原来的顶点或者SetupScratch::ClipOut
+};
+struct ClipPolygon {
+  ClipVertex Vertex[MAX_CLIP_VERTEX];
+  size_t Count;
+};
+//顶点在哪些裁剪平面外侧，第i位对应ClipPlane(i)
+static uint32_t GetOutcode(const Vector4f& v) noexcept {
+  uint32_t code = 0;
+  for (size_t i = 0; i < (size_t)ClipPlane::CLIP_SIZE; i++) {
+    if (!IsInsidePlane(v, (ClipPlane)i)) {
+      code |= 1u << i;
+    }
+  }
+  return code;
+}
+//对一个平面裁剪，新顶点的VS输出依次写入scratch
+//齐次空间里的插值比例就是透视矫正的插值；屏幕空间线性的输出要换算成屏幕空间的比例；flat的输出不插值，以后也不会读
+//退化的三角形因为浮点误差可能切出更多顶点，超出容量时返回false
+static bool SutherlandHodgemanAlgo(
     ClipPlane plane,
-    std::pmr::vector<Vector4f>& outPos, std::pmr::vector<Vector4f>& inPos,
-    std::pmr::vector<Span<uint8_t>>& outOut, std::pmr::vector<Span<uint8_t>> inOut,
-    size_t length, size_t floatCount,
-    PipelineMemory& memory) {
-  size_t inCount = inPos.size();
-  for (size_t i = 0; i < inCount; i++) {
-    size_t prev = (i - 1 + inCount) % inCount;
-    size_t curr = i;
-    bool isPrevInside = IsInsidePlane(inPos[prev], plane);
-    bool isCurrInside = IsInsidePlane(inPos[curr], plane);
+    const ClipPolygon& in, ClipPolygon& out,
+    Span<float>& scratch, size_t& scratchUsed, const VertexShaderOutLayout& layout) noexcept {
+  const size_t floatCount = layout.Size / sizeof(float);
+  out.Count = 0;
+  for (size_t i = 0; i < in.Count; i++) {
+    const ClipVertex& prev = in.Vertex[(i - 1 + in.Count) % in.Count];
+    const ClipVertex& curr = in.Vertex[i];
+    bool isPrevInside = IsInsidePlane(prev.Pos, plane);
+    bool isCurrInside = IsInsidePlane(curr.Pos, plane);
     //其中一个点在外部，求出交点信息，放入下一步
     if (isPrevInside != isCurrInside) {
-      float ratio = IntersectRatio(inPos[prev], inPos[curr], plane);
-      Span<uint8_t> newPoint = memory.AllocToSpan<uint8_t>(length);
-      LerpProperties(
-          ratio,
-          (float*)inOut[prev].GetPointer(), (float*)inOut[curr].GetPointer(),
-          (float*)newPoint.GetPointer(), floatCount);
-      outPos.emplace_back(Lerp(ratio, inPos[prev], inPos[curr]));
-      outOut.emplace_back(newPoint);
+      if (out.Count == MAX_CLIP_VERTEX || scratchUsed == MAX_CLIP_NEW_VERTEX) {
+        return false;
+      }
+      float ratio = IntersectRatio(prev.Pos, curr.Pos, plane);
+      float* newOut = scratch.GetPointer() + scratchUsed * floatCount;
+      scratchUsed++;
+      Vector4f newPos = Lerp(ratio, prev.Pos, curr.Pos);
+      layout.ForEachSegment([&](size_t begin, size_t end, Interpolation mode) {
+        switch (mode) {
+          case Interpolation::Perspective:
+          case Interpolation::Centroid:
+            LerpProperties(ratio, prev.Out + begin, curr.Out + begin, newOut + begin, end - begin);
+            break;
+          case Interpolation::NoPerspective:
+            LerpProperties(ratio * curr.Pos.W() / newPos.W(), prev.Out + begin, curr.Out + begin, newOut + begin, end - begin);
+            break;
+          default:
+            break;
+        }
+      });
+      out.Vertex[out.Count++] = {newPos, newOut};
     }
     //当前点在内部，肯定得放入下一步
     if (isCurrInside) {
-      outPos.emplace_back(inPos[curr]);
-      outOut.emplace_back(inOut[curr]);
+      if (out.Count == MAX_CLIP_VERTEX) {
+        return false;
+      }
+      out.Vertex[out.Count++] = curr;
     }
   }
+  return true;
+}
+//裁剪平面分两组，W和Z必须几何裁剪，X和Y可以交给防护带（guard band）
+constexpr uint32_t CLIP_MASK_XY = (1u << (size_t)ClipPlane::PositiveX) | (1u << (size_t)ClipPlane::NegativeX) |
+                                  (1u << (size_t)ClipPlane::PositiveY) | (1u << (size_t)ClipPlane::NegativeY);
+constexpr uint32_t CLIP_MASK_WZ = ((1u << (size_t)ClipPlane::CLIP_SIZE) - 1) & ~CLIP_MASK_XY;
+//防护带在视口外每边扩展的像素数。屏幕坐标不超过几万，float还剩1/512以上的精度，定点数边函数也不会溢出
+constexpr float GUARD_BAND_PIXELS = 8192.0f;
+//防护带在NDC下的范围，关掉的时候就是视口本身
+static Vector2f GetGuardBand(const PipelineInput& input, const PipelineState& pso) noexcept {
+  if (!pso.IsUseGuardBand || pso.IsDrawFrame) {
+    return Vector2f(1.0f, 1.0f);
+  }
+  return Vector2f(1.0f + 2.0f * GUARD_BAND_PIXELS / (float)input.FrameWidth,
+                  1.0f + 2.0f * GUARD_BAND_PIXELS / (float)input.FrameHeight);
+}
+static bool IsInsideGuardBand(const Vector4f& v, const Vector2f& guardBand) noexcept {
+  return std::abs(v.X()) <= guardBand.X() * v.W() && std::abs(v.Y()) <= guardBand.Y() * v.W();
 }
-static std::tuple<size_t, std::pmr::vector<Vector4f>, std::pmr::vector<Span<uint8_t>>> SutherlandHodgeman(
+//齐次空间裁剪，全部在栈上完成，只对顶点outcode实际跨过的平面（crossed）裁剪
+//三个顶点都在内部时什么都不做；被裁剪时新顶点的VS输出在scratch里，下一个三角形会覆盖它
+//先裁W和Z，剩下的顶点都在防护带内的话X和Y就不裁了，超出视口的部分由光栅化的包围盒剪掉
+static void SutherlandHodgeman(
     const Vector4f& clipA, const Vector4f& clipB, const Vector4f& clipC,
-    const Span<uint8_t>& outA, const Span<uint8_t>& outB, const Span<uint8_t>& outC, size_t length, size_t floatCount,
-    PipelineMemory& memory) {
-  std::pmr::vector<Vector4f> outputPos(memory.Arena);
-  outputPos.reserve(8);
-  outputPos.assign({clipA, clipB, clipC});
-  std::pmr::vector<Span<uint8_t>> outputOut(memory.Arena);
-  outputOut.reserve(8);
-  outputOut.assign({outA, outB, outC});
-  if (IsInClipSpace(clipA) && IsInClipSpace(clipB) && IsInClipSpace(clipC)) {
-    return std::make_tuple(3, outputPos, outputOut);
+    const float* outA, const float* outB, const float* outC,
+    uint32_t crossed, const Vector2f& guardBand,
+    Span<float>& scratch, const VertexShaderOutLayout& layout,
+    ClipPolygon& result) noexcept {
+  result.Vertex[0] = {clipA, outA};
+  result.Vertex[1] = {clipB, outB};
+  result.Vertex[2] = {clipC, outC};
+  result.Count = 3;
+  if (crossed == 0) {
+    return;
   }
-  std::pmr::vector<Vector4f> inputPos(memory.Arena);
-  inputPos.reserve(8);
-  std::pmr::vector<Span<uint8_t>> inputOut(memory.Arena);
-  inputOut.reserve(8);
-  for (size_t i = 0; i < 7; i++) {
-    if (i % 2 == 0) {
-      inputPos.clear();
-      inputOut.clear();
-      SutherlandHodgemanAlgo(
-          (ClipPlane)i,
-          inputPos, outputPos,
-          inputOut, outputOut, length, floatCount,
-          memory);
-    } else {
-      outputPos.clear();
-      outputOut.clear();
-      SutherlandHodgemanAlgo(
-          (ClipPlane)i,
-          outputPos, inputPos,
-          outputOut, inputOut, length, floatCount,
-          memory);
+  ClipPolygon temp;
+  ClipPolygon* in = &result;
+  ClipPolygon* out = &temp;
+  size_t scratchUsed = 0;
+  auto clipPlanes = [&](uint32_t planes) -> bool {
+    for (size_t i = 0; i < (size_t)ClipPlane::CLIP_SIZE; i++) {
+      if ((planes & (1u << i)) == 0) {
+        continue;
+      }
+      if (!SutherlandHodgemanAlgo((ClipPlane)i, *in, *out, scratch, scratchUsed, layout) || out->Count < 3) {
+        return false;
+      }
+      std::swap(in, out);
     }
+    return true;
+  };
+  if (!clipPlanes(crossed & CLIP_MASK_WZ)) {
+    result.Count = 0;
+    return;
   }
-  return std::make_tuple(outputPos.size(), std::move(outputPos), std::move(outputOut));
-}
-constexpr static bool TestImpl(float depth, float target, TestComparison func) noexcept {
-  switch (func) {
-    case hackri::TestComparison::Never:
-      return false;
-    case hackri::TestComparison::Less:
-      return depth < target;
-    case hackri::TestComparison::Equal:
-      return std::abs(depth - target) <= float(1e-5);
-    case hackri::TestComparison::LessEqual:
-      return depth <= target;
-    case hackri::TestComparison::Greater:
-      return depth > target;
-    case hackri::TestComparison::NotEqual:
-      return std::abs(depth - target) > float(1e-5);
-    case hackri::TestComparison::GreaterEqual:
-      return depth >= target;
-    case hackri::TestComparison::Always:
-      return true;
-    default:
-      return false;
+  if ((crossed & CLIP_MASK_XY) != 0) {
+    bool isInGuardBand = true;
+    for (size_t i = 0; i < in->Count; i++) {
+      isInGuardBand = isInGuardBand && IsInsideGuardBand(in->Vertex[i].Pos, guardBand);
+    }
+    if (!isInGuardBand && !clipPlanes(crossed & CLIP_MASK_XY)) {
+      result.Count = 0;
+      return;
+    }
   }
-}
-constexpr static Color4f GetBlendFactor(const Color4f& src, const Color4f& dst, const Color4f& c, BlendColor type) noexcept {
-  switch (type) {
-    case hackri::BlendColor::Zero:
-      return Color4f(0.0f);
-    case hackri::BlendColor::One:
-      return Color4f(1.0f);
-    case hackri::BlendColor::SrcColor:
-      return src;
-    case hackri::BlendColor::OneMinusSrcColor:
-      return Color4f(1.0f) - src;
-    case hackri::BlendColor::DstColor:
-      return dst;
-    case hackri::BlendColor::OneMinusDstColor:
-      return Color4f(1.0f) - dst;
-    case hackri::BlendColor::SrcAlpha:
-      return Color4f(src.A());
-    case hackri::BlendColor::OneMinusSrcAlpha:
-      return Color4f(1.0f) - Color4f(src.A());
-    case hackri::BlendColor::DstAlpha:
-      return Color4f(dst.A());
-    case hackri::BlendColor::OneMinusDstAlpha:
-      return Color4f(1.0f) - Color4f(dst.A());
-    case hackri::BlendColor::ConstantColor:
-      return c;
-    case hackri::BlendColor::OneMinusConstantColor:
-      return Color4f(1.0f) - c;
-    case hackri::BlendColor::ConstantAlpha:
-      return Color4f(c.A());
-    case hackri::BlendColor::OneMinusConstantAlpha:
-      return Color4f(1.0f) - Color4f(c.A());
-    default:
-      return Color4f(0.0f);
+  if (in != &result) {
+    result = *in;
   }
 }
-constexpr static Color4f Blend(
-    const PipelineState& pso,
-    const Color4f& src, const Color4f& dst) noexcept {
-  Color3f srcRgbFactor = GetBlendFactor(src, dst, pso.BlendColorConstant, pso.BlendSrcFactorRGB).XYZ();
-  Color3f dstRgbFactor = GetBlendFactor(src, dst, pso.BlendColorConstant, pso.BlendDstFactorRGB).XYZ();
-  float srcAFactor = GetBlendFactor(src, dst, pso.BlendColorConstant, pso.BlendSrcFactorA).A();
-  float dstAFactor = GetBlendFactor(src, dst, pso.BlendColorConstant, pso.BlendDstFactorA).A();
-  switch (pso.BlendOp) {
-    case hackri::BlendEquation::Add:
-      return Color4f(
-          src.XYZ() * srcRgbFactor + dst.XYZ() * dstRgbFactor,
-          src.A() * srcAFactor + dst.A() * dstAFactor);
-    case hackri::BlendEquation::Sub:
-      return Color4f(
-          src.XYZ() * srcRgbFactor - dst.XYZ() * dstRgbFactor,
-          src.A() * srcAFactor - dst.A() * dstAFactor);
-    case hackri::BlendEquation::RevSub:
-      return Color4f(
-          dst.XYZ() * dstRgbFactor - src.XYZ() * srcRgbFactor,
-          dst.A() * dstAFactor - src.A() * srcAFactor);
-    default:
-      return Color4f(0.0f);
+//单个像素的深度测试，通过时写入并扩大Hi-Z的范围
+template <class T>
+static bool TestAndWriteDepth(Buffer2d<T>& depthBuffer, HiZBuffer* hiz, uint32_t x, uint32_t y, float depth, TestComparison test) noexcept {
+  T value = DepthFormat<T>::Encode(depth);
+  if (!TestImpl((float)value, (float)depthBuffer(x, y), test)) {
+    return false;
   }
+  depthBuffer(x, y) = value;
+  if (hiz != nullptr) {
+    hiz->Expand(x, y, value);
+  }
+  return true;
 }
 static void DrawInterpolateLine(
     const PipelineInput& input, const PipelineState& pso,
     const Array<uint32_t, 2>& a, const Array<uint32_t, 2>& b,
     float depthA, float depthB,
-    Span<float> outA, Span<float> outB, Span<float>& psIn, size_t len) {
+    const float* outA, const float* outB, const float* flat, Span<float>& psIn) {
   PixelShaderParams psParam{psIn.Cast<uint8_t>().GetPointer(), input.CBuffer};
-  auto& cb = *input.ColorBuffer;
+  ColorTarget colorTarget(input);
   auto depthTestAndWrite = [&](float delta, uint32_t x, uint32_t y) -> void {
-    if (input.DepthBuffer != nullptr) {
-      float depth = Lerp(delta, depthA, depthB);
-      if (!TestImpl(depth, (*input.DepthBuffer)(x, y), pso.DepthTest)) {
+    float depth = Lerp(delta, depthA, depthB);
+    if (input.Depth16Buffer != nullptr) {
+      if (!TestAndWriteDepth(*input.Depth16Buffer, input.HiZ, x, y, depth, pso.DepthTest)) {
+        return;
+      }
+    } else if (input.Depth24Buffer != nullptr) {
+      if (!TestAndWriteDepth(*input.Depth24Buffer, input.HiZ, x, y, depth, pso.DepthTest)) {
+        return;
+      }
+    } else if (input.DepthBuffer != nullptr) {
+      if (!TestAndWriteDepth(*input.DepthBuffer, input.HiZ, x, y, depth, pso.DepthTest)) {
         return;
       }
-      (*input.DepthBuffer)(x, y) = depth;
     }
-    LerpProperties(delta, outA.GetPointer(), outB.GetPointer(), psIn.GetPointer(), len);
+    if (!input.HasColorTarget()) {  //只写深度
+      return;
+    }
+    //线段在屏幕空间线性插值，flat的输出直接用provoking vertex的
+    pso.OutLayout.ForEachSegment([&](size_t begin, size_t end, Interpolation mode) {
+      if (mode == Interpolation::Flat) {
+        std::copy(flat + begin, flat + end, psIn.GetPointer() + begin);
+      } else {
+        LerpProperties(delta, outA + begin, outB + begin, psIn.GetPointer() + begin, end - begin);
+      }
+    });
     bool isDiscard = false;
     Color4f src = pso.PS(psParam, isDiscard);
     if (isDiscard) {
       return;
     }
-    if (pso.IsUseAlphaTest) {
-      if (!TestImpl(src.A(), cb(x, y).A(), pso.AlphaTest)) {
-        return;
-      }
-    }
-    if (pso.IsUseBlend) {
-      Color4f dst = cb(x, y);
-      cb(x, y) = Blend(pso, src, dst);
-    } else {
-      cb(x, y) = src;
-    }
+    OutputMerge<BlendFromPSO>(pso, colorTarget, x, y, src);
   };
   uint32_t x1 = a.X(), y1 = a.Y(), x2 = b.X(), y2 = b.Y();
   if (x1 == x2 && y1 == y2) {
@@ -426,68 +425,91 @@ static void DrawInterpolateLine(
     }
   }
 }
-static bool IsCull(const Span<Vector3f>& ndc, CullMode mode, FrontFace face) noexcept {
-  float area = ndc[0].X() * ndc[1].Y() - ndc[0].Y() * ndc[1].X() +
-               ndc[1].X() * ndc[2].Y() - ndc[1].Y() * ndc[2].X() +
-               ndc[2].X() * ndc[0].Y() - ndc[2].Y() * ndc[0].X();
+//齐次空间的面剔除，裁剪之前就能做（Olano and Greer 1997）
+//det[x y w] = wa * wb * wc * NDC下的有向面积，w有正有负时符号也对应裁剪后可见部分的朝向
+static bool IsCull(const Vector4f& a, const Vector4f& b, const Vector4f& c, CullMode mode, FrontFace face) noexcept {
   switch (mode) {
     case hackri::CullMode::None:
       return false;
-    case hackri::CullMode::Back:
-      return face == FrontFace::CCW ? area <= 0 : area > 0;
-    case hackri::CullMode::Front:
-      return face == FrontFace::CCW ? area > 0 : area <= 0;
     case hackri::CullMode::BackAndFront:
       return true;
+    default:
+      break;
+  }
+  float det = a.X() * (b.Y() * c.W() - b.W() * c.Y()) -
+              a.Y() * (b.X() * c.W() - b.W() * c.X()) +
+              a.W() * (b.X() * c.Y() - b.Y() * c.X());
+  switch (mode) {
+    case hackri::CullMode::Back:
+      return face == FrontFace::CCW ? det <= 0 : det > 0;
+    case hackri::CullMode::Front:
+      return face == FrontFace::CCW ? det > 0 : det <= 0;
     default:
       return false;
   }
 }
-void Renderer::DrawTriangle(
+//#############
+//# 三角形设置 #
+//#############
+SetupScratch hackri::AllocateSetupScratch(const PipelineState& pso, PipelineMemory& memory) {
+  SetupScratch scratch;
+  scratch.PsIn = memory.AllocToSpan<uint8_t>(pso.OutLayout.Size);
+  scratch.ClipOut = memory.AllocToSpan<float>(MAX_CLIP_NEW_VERTEX * (pso.OutLayout.Size / sizeof(float)));
+  return scratch;
+}
+void hackri::SetupClipSpaceTriangle(
     const PipelineInput& input,
     const PipelineState& pso,
-    PipelineMemory& memory) {
-  const size_t vsOutSize = pso.OutLayout.Size;             //顶点着色器输出大小
-  const size_t vsOutFloatCnt = vsOutSize / sizeof(float);  //需要插值数量
-  assert((vsOutSize % sizeof(float)) == 0);                //所有输出都必须可以插值
-  //初始化内存
-  Span<Vector4f> clipPos = memory.AllocToSpan<Vector4f>(3);
-  Span<uint8_t> vsOutA = memory.AllocToSpan<uint8_t>(vsOutSize);
-  Span<uint8_t> vsOutB = memory.AllocToSpan<uint8_t>(vsOutSize);
-  Span<uint8_t> vsOutC = memory.AllocToSpan<uint8_t>(vsOutSize);
-  Span<uint8_t> psIn = memory.AllocToSpan<uint8_t>(vsOutSize);
-  Span<Vector3f> ndc = memory.AllocToSpan<Vector3f>(3);
-  Span<Vector2f> scrPos = memory.AllocToSpan<Vector2f>(3);
-  Span<float> depthZ = memory.AllocToSpan<float>(3);
-  //运行VS，计算顶点在clip space的坐标
-  for (int i = 0; i < 3; i++) {
-    VertexShaderParams vsParam{input.Vertex,
-                               {vsOutA.GetPointer(), vsOutB.GetPointer(), vsOutC.GetPointer()},
-                               input.CBuffer};
-    clipPos[i] = pso.VS(i, vsParam);
+    PipelineMemory& memory,
+    uint32_t primitiveID,
+    const Vector4f& clipPosA, const Vector4f& clipPosB, const Vector4f& clipPosC,
+    const Span<uint8_t>& vsOutA, const Span<uint8_t>& vsOutB, const Span<uint8_t>& vsOutC,
+    SetupScratch& scratch,
+    std::pmr::vector<TriangleSetup>& triangles) {
+  assert(!pso.IsDrawFrame || (input.VisibilityBuffer == nullptr && input.Multisample == nullptr));  //线框模式不支持可见性缓冲和MSAA
+  //只写深度（包括写可见性缓冲）时不需要任何VS输出，裁剪时也不用插值
+  static const VertexShaderOutLayout depthOnlyLayout = {0};
+  const bool isDepthOnly = !input.IsShadePixel();
+  const VertexShaderOutLayout& layout = isDepthOnly ? depthOnlyLayout : pso.OutLayout;
+  const size_t vsOutFloatCnt = layout.Size / sizeof(float);  //需要插值数量
+  Vector3f ndcArr[3];
+  Vector2f scrPosArr[3];
+  float depthZArr[3];
+  Span<Vector3f> ndc(ndcArr, 3);
+  Span<Vector2f> scrPos(scrPosArr, 3);
+  Span<float> depthZ(depthZArr, 3);
+  //三个顶点在同一个裁剪平面外侧，整个三角形都看不见
+  const uint32_t codeA = GetOutcode(clipPosA), codeB = GetOutcode(clipPosB), codeC = GetOutcode(clipPosC);
+  if ((codeA & codeB & codeC) != 0) {
+    return;
   }
+  //面剔除，裁剪出来的三角形朝向和原三角形一样，在裁剪之前做
+  if (IsCull(clipPosA, clipPosB, clipPosC, pso.Cull, pso.FrontOrder)) {
+    return;
+  }
+  //flat插值的输出都来自原三角形的第一个顶点，裁剪出来的新顶点里没有
+  const float* provoking = vsOutA.Cast<float>().GetPointer();
   //齐次空间裁剪
-  const auto [vertexCount, outPos, outOut] = SutherlandHodgeman(
-      clipPos[0], clipPos[1], clipPos[2],
-      vsOutA, vsOutB, vsOutC, vsOutSize, vsOutFloatCnt,
-      memory);
-  for (int i = 0; i < (int)vertexCount - 2; i++) {
-    const Vector4f& clipA = outPos[0];
-    const Vector4f& clipB = outPos[i + 1];
-    const Vector4f& clipC = outPos[i + 2];
-    const Span<float> outA = outOut[0].Cast<float>();
-    const Span<float> outB = outOut[i + 1].Cast<float>();
-    const Span<float> outC = outOut[i + 2].Cast<float>();
-    Span<float> pixelInput = psIn.Cast<float>();
+  ClipPolygon polygon;
+  SutherlandHodgeman(
+      clipPosA, clipPosB, clipPosC,
+      vsOutA.Cast<float>().GetPointer(), vsOutB.Cast<float>().GetPointer(), vsOutC.Cast<float>().GetPointer(),
+      codeA | codeB | codeC, GetGuardBand(input, pso),
+      scratch.ClipOut, layout,
+      polygon);
+  for (int i = 0; i < (int)polygon.Count - 2; i++) {
+    const Vector4f& clipA = polygon.Vertex[0].Pos;
+    const Vector4f& clipB = polygon.Vertex[i + 1].Pos;
+    const Vector4f& clipC = polygon.Vertex[i + 2].Pos;
+    const float* outA = polygon.Vertex[0].Out;
+    const float* outB = polygon.Vertex[i + 1].Out;
+    const float* outC = polygon.Vertex[i + 2].Out;
+    Span<float> pixelInput = scratch.PsIn.Cast<float>();
     //透视除法，将顶点转化到规范化设备坐标(NDC)
     Vector3f invW(1.0f / clipA.W(), 1.0f / clipB.W(), 1.0f / clipC.W());
     ndc[0] = clipA.XYZ() * invW[0];
     ndc[1] = clipB.XYZ() * invW[1];
     ndc[2] = clipC.XYZ() * invW[2];
-    //面剔除
-    if (IsCull(ndc, pso.Cull, pso.FrontOrder)) {
-      continue;
-    }
     //视口变换，转化到屏幕空间坐标
     for (int i = 0; i < 3; i++) {
       Vector3f sp = ViewportTransform(input.FrameWidth, input.FrameHeight, ndc[i]);
@@ -503,64 +525,205 @@ void Renderer::DrawTriangle(
       auto la = toInt(scrPos[0], input.FrameWidth, input.FrameHeight);
       auto lb = toInt(scrPos[1], input.FrameWidth, input.FrameHeight);
       auto lc = toInt(scrPos[2], input.FrameWidth, input.FrameHeight);
-      DrawInterpolateLine(input, pso, la, lb, depthZ[0], depthZ[1], outA, outB, pixelInput, vsOutFloatCnt);
-      DrawInterpolateLine(input, pso, la, lc, depthZ[0], depthZ[2], outA, outC, pixelInput, vsOutFloatCnt);
-      DrawInterpolateLine(input, pso, lb, lc, depthZ[1], depthZ[2], outB, outC, pixelInput, vsOutFloatCnt);
+      DrawInterpolateLine(input, pso, la, lb, depthZ[0], depthZ[1], outA, outB, provoking, pixelInput);
+      DrawInterpolateLine(input, pso, la, lc, depthZ[0], depthZ[2], outA, outC, provoking, pixelInput);
+      DrawInterpolateLine(input, pso, lb, lc, depthZ[1], depthZ[2], outB, outC, provoking, pixelInput);
     } else {
+      TriangleSetup tri;
+      tri.PrimitiveID = primitiveID;
+      for (int i = 0; i < 3; i++) {
+        tri.ScrPos[i] = scrPos[i];
+        tri.DepthZ[i] = depthZ[i];
+      }
+      const float* out[3] = {outA, outB, outC};
+      //顶点吸附到定点数网格上，构造边函数
+      int64_t fx[3], fy[3];
+      for (int i = 0; i < 3; i++) {
+        fx[i] = ToSubpixel(scrPos[i].X());
+        fy[i] = ToSubpixel(scrPos[i].Y());
+      }
+      int64_t area = (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fy[1] - fy[0]) * (fx[2] - fx[0]);
+      if (area == 0) {  //退化成线或点，不覆盖任何像素
+        continue;
+      }
+      if (area < 0) {  //统一成逆时针，保证内部的边函数为正
+        std::swap(fx[1], fx[2]);
+        std::swap(fy[1], fy[2]);
+        std::swap(tri.ScrPos[1], tri.ScrPos[2]);
+        std::swap(tri.DepthZ[1], tri.DepthZ[2]);
+        std::swap(invW[1], invW[2]);
+        std::swap(out[1], out[2]);
+        area = -area;
+      }
+      tri.Edge[0] = MakeEdge(fx[1], fy[1], fx[2], fy[2]);
+      tri.Edge[1] = MakeEdge(fx[2], fy[2], fx[0], fy[0]);
+      tri.Edge[2] = MakeEdge(fx[0], fy[0], fx[1], fy[1]);
+      //SIMD实现里块内的边函数用int32计算，要求一列8个像素的增量不超过2^30
+      for (int i = 0; i < 3; i++) {
+        assert(std::abs(tri.Edge[i].StepY()) * (int64_t)BLOCK_SIZE < (int64_t(1) << 30));
+      }
+      //深度平面，z = Σ z[i] * E[i] / area，对x、y求导就是梯度
+      double invArea = 1.0 / (double)area;
+      double dzdx = 0, dzdy = 0;
+      for (int i = 0; i < 3; i++) {
+        dzdx += (double)tri.DepthZ[i] * (double)tri.Edge[i].StepX() * invArea;
+        dzdy += (double)tri.DepthZ[i] * (double)tri.Edge[i].StepY() * invArea;
+      }
+      tri.DepthPlane = Vector3f((float)dzdx, (float)dzdy, tri.DepthZ[0]);
+      tri.PlaneOrigin = Vector2f((float)fx[0] / (float)SUBPIXEL_SCALE, (float)fy[0] / (float)SUBPIXEL_SCALE);
       //根据屏幕空间坐标计算包围盒
-      Array<uint32_t, 4> bbox = FindBoundingBox(scrPos, input.FrameWidth, input.FrameHeight);
-      for (uint32_t x = bbox[0]; x <= bbox[2]; x++) {
-        for (uint32_t y = bbox[1]; y <= bbox[3]; y++) {
-          Vector2f point((float)x + 0.5f, (float)y + 0.5f);
-          //计算重心坐标用于插值
-          Vector3f bary = GetBaryCoord(point, scrPos);
-          //如果重心坐标出现小于0，说明屏幕坐标位于三角形外部
-          if (!IsInTriangle(bary)) {
-            continue;
-          }
-          //插值深度
-          float depth = InterpolateDepth(bary, depthZ);
-          //深度测试
-          if (input.DepthBuffer != nullptr && pso.IsUseDepthTest) {
-            auto& db = *input.DepthBuffer;
-            if (!TestImpl(depth, db(x, y), pso.DepthTest)) {
-              continue;
-            }
-            //更新深度值
-            db(x, y) = depth;
-          }
-          //插值顶点属性。透视矫正，使用inv w作为权重
-          Vector3f weight = invW * bary;
-          float normalize = 1.0f / (weight[0] + weight[1] + weight[2]);
-          for (size_t i = 0; i < vsOutFloatCnt; i++) {
-            float sum = outA[i] * weight.X() + outB[i] * weight.Y() + outC[i] * weight.Z();
-            pixelInput[i] = sum * normalize;
-          }
-          //使用插值后的结果计算像素颜色
-          auto& cb = *input.ColorBuffer;
-          PixelShaderParams psParam{psIn.GetPointer(), input.CBuffer};
-          bool isDiscard = false;
-          Color4f src = pso.PS(psParam, isDiscard);
-          if (isDiscard) {  //丢弃PS结果
-            continue;
-          }
-          //alpha测试
-          if (pso.IsUseAlphaTest) {
-            if (!TestImpl(src.A(), cb(x, y).A(), pso.AlphaTest)) {
-              continue;
+      tri.BBox = FindBoundingBox(scrPos, input.FrameWidth, input.FrameHeight);
+      if (tri.BBox[0] > tri.BBox[2] || tri.BBox[1] > tri.BBox[3]) {
+        continue;
+      }
+      //Hi-Z剔除用的深度范围。DepthAt的每一步浮点运算误差都不超过eps倍的操作数，放大一点作为上界
+      tri.DepthMin = std::min({tri.DepthZ[0], tri.DepthZ[1], tri.DepthZ[2]});
+      tri.DepthMax = std::max({tri.DepthZ[0], tri.DepthZ[1], tri.DepthZ[2]});
+      float maxDx = std::max(std::abs((float)tri.BBox[0] + 0.5f - tri.PlaneOrigin.X()), std::abs((float)tri.BBox[2] + 0.5f - tri.PlaneOrigin.X()));
+      float maxDy = std::max(std::abs((float)tri.BBox[1] + 0.5f - tri.PlaneOrigin.Y()), std::abs((float)tri.BBox[3] + 0.5f - tri.PlaneOrigin.Y()));
+      tri.DepthError = 4 * std::numeric_limits<float>::epsilon() *
+                       (std::abs(tri.DepthPlane.Z()) + std::abs(tri.DepthPlane.X()) * maxDx + std::abs(tri.DepthPlane.Y()) * maxDy);
+      //透视矫正用的1/w和attr/w平面，求法和深度平面一样，原点的值就是0号顶点的值
+      float baryDx[3], baryDy[3];
+      for (int i = 0; i < 3; i++) {
+        baryDx[i] = (float)((double)tri.Edge[i].StepX() * invArea);
+        baryDy[i] = (float)((double)tri.Edge[i].StepY() * invArea);
+      }
+      auto makePlane = [&](float a, float b, float c) -> Vector3f {
+        return Vector3f(a * baryDx[0] + b * baryDx[1] + c * baryDx[2], a * baryDy[0] + b * baryDy[1] + c * baryDy[2], a);
+      };
+      tri.InvWPlane = makePlane(invW[0], invW[1], invW[2]);
+      if (vsOutFloatCnt > 0) {
+        //屏幕空间线性的输出直接用attr的平面，flat的输出梯度是0
+        Vector3f* attrPlane = memory.Allocate<Vector3f>(vsOutFloatCnt);
+        layout.ForEachSegment([&](size_t begin, size_t end, Interpolation mode) {
+          for (size_t k = begin; k < end; k++) {
+            switch (mode) {
+              case Interpolation::Perspective:
+              case Interpolation::Centroid:
+                attrPlane[k] = makePlane(out[0][k] * invW[0], out[1][k] * invW[1], out[2][k] * invW[2]);
+                break;
+              case Interpolation::NoPerspective:
+                attrPlane[k] = makePlane(out[0][k], out[1][k], out[2][k]);
+                break;
+              case Interpolation::Flat:
+                attrPlane[k] = Vector3f(0.0f, 0.0f, provoking[k]);
+                break;
             }
           }
-          if (pso.IsUseBlend) {
-            Color4f dst = cb(x, y);
-            //混合
-            cb(x, y) = Blend(pso, src, dst);
-          } else {
-            cb(x, y) = src;
-          }
+        });
+        tri.AttrPlane = attrPlane;
+      } else {
+        tri.AttrPlane = nullptr;
+      }
+      triangles.emplace_back(tri);
+    }
+  }
+}
+TileBins hackri::BinTriangles(
+    const PipelineInput& input,
+    PipelineMemory& memory,
+    const std::pmr::vector<TriangleSetup>& triangles,
+    HiZBuffer* hiz, TestComparison test) {
+  TileBins result;
+  result.CountX = (input.FrameWidth + TILE_SIZE - 1) / TILE_SIZE;
+  result.CountY = (input.FrameHeight + TILE_SIZE - 1) / TILE_SIZE;
+  const uint32_t tileCountY = result.CountY;
+  const size_t tileCount = result.GetTileCount();
+  auto isInTile = [&](const TriangleSetup& tri, uint32_t tx, uint32_t ty) -> bool {
+    if (hiz == nullptr) {
+      return true;
+    }
+    auto bound = tri.DepthBound(
+        std::max(tri.BBox[0], tx * TILE_SIZE), std::max(tri.BBox[1], ty * TILE_SIZE),
+        std::min(tri.BBox[2], (tx + 1) * TILE_SIZE - 1), std::min(tri.BBox[3], (ty + 1) * TILE_SIZE - 1));
+    return !IsHiZReject(bound, hiz->GetCoarse(tx, ty), test);
+  };
+  //计数排序，先数每个tile有多少三角形，再填入连续的数组
+  Span<uint32_t> binStart = memory.AllocToSpan<uint32_t>(tileCount + 1);
+  binStart.Fill(0);
+  for (const TriangleSetup& tri : triangles) {
+    for (uint32_t tx = tri.BBox[0] / TILE_SIZE; tx <= tri.BBox[2] / TILE_SIZE; tx++) {
+      for (uint32_t ty = tri.BBox[1] / TILE_SIZE; ty <= tri.BBox[3] / TILE_SIZE; ty++) {
+        if (isInTile(tri, tx, ty)) {
+          binStart[size_t(tx) * tileCountY + ty + 1]++;
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < tileCount; i++) {
+    binStart[i + 1] += binStart[i];
+  }
+  Span<uint32_t> binCursor = memory.AllocToSpan<uint32_t>(tileCount);
+  for (size_t i = 0; i < tileCount; i++) {
+    binCursor[i] = binStart[i];
+  }
+  Span<uint32_t> bins = memory.AllocToSpan<uint32_t>(binStart[tileCount]);
+  for (uint32_t i = 0; i < (uint32_t)triangles.size(); i++) {
+    const TriangleSetup& tri = triangles[i];
+    for (uint32_t tx = tri.BBox[0] / TILE_SIZE; tx <= tri.BBox[2] / TILE_SIZE; tx++) {
+      for (uint32_t ty = tri.BBox[1] / TILE_SIZE; ty <= tri.BBox[3] / TILE_SIZE; ty++) {
+        if (isInTile(tri, tx, ty)) {
+          bins[binCursor[size_t(tx) * tileCountY + ty]++] = i;
         }
       }
     }
   }
+  result.Start = binStart;
+  result.Triangles = bins;
+  return result;
+}
+//###########
+//# 绘制命令 #
+//###########
+void Renderer::DrawTriangle(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    PipelineMemory& memory) {
+  const size_t vsOutSize = pso.OutLayout.Size;  //顶点着色器输出大小
+  assert((vsOutSize % sizeof(float)) == 0);     //所有输出都必须可以插值
+  //初始化内存
+  Span<Vector4f> clipPos = memory.AllocToSpan<Vector4f>(3);
+  Span<uint8_t> vsOutA = memory.AllocToSpan<uint8_t>(vsOutSize);
+  Span<uint8_t> vsOutB = memory.AllocToSpan<uint8_t>(vsOutSize);
+  Span<uint8_t> vsOutC = memory.AllocToSpan<uint8_t>(vsOutSize);
+  SetupScratch scratch = AllocateSetupScratch(pso, memory);
+  //运行VS，计算顶点在clip space的坐标
+  for (int i = 0; i < 3; i++) {
+    VertexShaderParams vsParam{input.Vertex,
+                               {vsOutA.GetPointer(), vsOutB.GetPointer(), vsOutC.GetPointer()},
+                               input.CBuffer};
+    clipPos[i] = pso.VS(i, vsParam);
+  }
+  std::pmr::vector<TriangleSetup> triangles(memory.Arena);
+  SetupClipSpaceTriangle(
+      input, pso, memory, 0,
+      clipPos[0], clipPos[1], clipPos[2],
+      vsOutA, vsOutB, vsOutC,
+      scratch, triangles);
+  if (pso.PSBatch) {
+    RasterizeTriangles<DepthFromPSO, BlendFromPSO>(input, pso, memory, triangles, pso.PSBatch);
+  } else {
+    RasterizeTriangles<DepthFromPSO, BlendFromPSO>(input, pso, memory, triangles, pso.PS);
+  }
+}
+void Renderer::DrawIndexed(
+    const PipelineInput& input,
+    const size_t* indices, size_t indexCount,
+    const PipelineState& pso,
+    PipelineMemory& memory) {
+  auto draw = [&](const auto& vs) -> void {
+    if (pso.PSBatch) {
+      DrawIndexedImpl<DepthFromPSO, BlendFromPSO>(input, indices, indexCount, pso, memory, vs, pso.PSBatch);
+    } else {
+      DrawIndexedImpl<DepthFromPSO, BlendFromPSO>(input, indices, indexCount, pso, memory, vs, pso.PS);
+    }
+  };
+  if (pso.VSBatch) {
+    draw(pso.VSBatch);
+  } else {
+    draw(pso.VS);
+  }
 }
 
 PipelineState Renderer::DefaultPSO(VertexShader vs, PixelShader ps, size_t vertexSize, size_t outSize) noexcept {
@@ -570,6 +733,7 @@ PipelineState Renderer::DefaultPSO(VertexShader vs, PixelShader ps, size_t verte
   pso.VertexSize = vertexSize;
   pso.OutLayout = {outSize};
   pso.IsDrawFrame = false;
+  pso.IsUseGuardBand = true;
   pso.IsUseDepthTest = true;
   pso.DepthTest = TestComparison::Less;
   pso.Cull = CullMode::None;
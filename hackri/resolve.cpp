@@ -0,0 +1,241 @@
+#include <hackri/renderer.h>
+#include <hackri/simd.h>
+
+#include <algorithm>
+
+using namespace hackri;
+
+static_assert(sizeof(Color4f) == sizeof(float) * 4, "Color4f must be 4 packed floats");
+
+//PackColor的结果是R在最低字节，交换R和B
+static uint32_t SwapRB(uint32_t rgba) noexcept {
+  return (rgba & 0xff00ff00) | ((rgba & 0xff) << 16) | ((rgba >> 16) & 0xff);
+}
+static uint32_t ResolvePixel(const Color4f& color, const ResolveOptions& options) noexcept {
+  uint32_t rgba = PackColor(color, options.IsSrgb ? ColorFormat::RGBA8Srgb : ColorFormat::RGBA8Unorm);
+  return options.IsBGRA ? SwapRB(rgba) : rgba;
+}
+//连续的count个像素转换到result
+static void ResolveRun(const Color4f* src, size_t count, const ResolveOptions& options, uint32_t* result) noexcept {
+  size_t i = 0;
+#if defined(HACKRI_SIMD_X86)
+  //SSE2是x86-64的基础指令集，不需要运行时选择。一个寄存器是一个像素，4个像素一起打包成字节
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(255.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const SrgbEncodeTable& table = GetSrgbEncodeTable();
+  //和PackColor一样：钳制、乘255、加0.5后截断。NaN被_mm_max_ps换成0，和EncodeSrgb8一致
+  auto convertUnorm = [&](__m128 v) -> __m128i {
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale), half));
+  };
+  auto convert = [&](const Color4f& color) -> __m128i {
+    __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(reinterpret_cast<const float*>(&color)), zero), one);
+    __m128i rgba;
+    if (options.IsSrgb) {
+      //SSE2没有gather，区间下标用SIMD算出来以后逐个查表，阈值比较和进位还是SIMD，A走unorm
+      alignas(16) int32_t bucket[4];
+      _mm_store_si128(reinterpret_cast<__m128i*>(bucket),
+                      _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(v, _mm_set1_ps((float)SRGB_BUCKET_COUNT)),
+                                                  _mm_set1_ps((float)(SRGB_BUCKET_COUNT - 1)))));
+      const int32_t r = table.Bucket[bucket[0]], g = table.Bucket[bucket[1]], b = table.Bucket[bucket[2]];
+      const __m128 threshold = _mm_setr_ps(table.Threshold[r], table.Threshold[g], table.Threshold[b], 2.0f);
+      //比较结果是-1，减掉就是进一位
+      const __m128i code = _mm_sub_epi32(_mm_setr_epi32(r, g, b, 0), _mm_castps_si128(_mm_cmpge_ps(v, threshold)));
+      const __m128i alphaMask = _mm_setr_epi32(0, 0, 0, -1);
+      rgba = _mm_or_si128(_mm_andnot_si128(alphaMask, code), _mm_and_si128(alphaMask, convertUnorm(v)));
+    } else {
+      rgba = convertUnorm(v);
+    }
+    return options.IsBGRA ? _mm_shuffle_epi32(rgba, _MM_SHUFFLE(3, 0, 1, 2)) : rgba;
+  };
+  for (; i + 4 <= count; i += 4) {
+    __m128i p01 = _mm_packs_epi32(convert(src[i]), convert(src[i + 1]));
+    __m128i p23 = _mm_packs_epi32(convert(src[i + 2]), convert(src[i + 3]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(result + i), _mm_packus_epi16(p01, p23));
+  }
+#endif
+  for (; i < count; i++) {
+    result[i] = ResolvePixel(src[i], options);
+  }
+}
+
+void Renderer::Resolve(
+    const Buffer2d<Color4f>& color, Bitmap& target,
+    const ResolveOptions& options,
+    ThreadPool* workers) {
+  assert(color.GetWidth() == (uint32_t)target.GetW() && color.GetHeight() == (uint32_t)target.GetH());
+  constexpr uint32_t tileSize = Buffer2d<Color4f>::LAYOUT_TILE_SIZE;
+  constexpr uint32_t blockSize = Buffer2d<Color4f>::LAYOUT_BLOCK_SIZE;
+  const uint32_t width = color.GetWidth(), height = color.GetHeight();
+  const uint32_t tileCountX = (width + tileSize - 1) / tileSize;
+  const uint32_t tileCountY = (height + tileSize - 1) / tileSize;
+  auto task = [&](size_t tile, size_t) -> void {
+    const uint32_t x0 = uint32_t(tile / tileCountY) * tileSize, y0 = uint32_t(tile % tileCountY) * tileSize;
+    const uint32_t x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+    //每个tile只查一次行地址
+    uint32_t* rows[tileSize];
+    for (uint32_t y = y0; y < y1; y++) {
+      rows[y - y0] = reinterpret_cast<uint32_t*>(target.GetLine(options.IsFlipVertical ? int(height - 1 - y) : int(y)));
+    }
+    if (color.IsPendingClear(x0, y0)) {
+      const uint32_t value = ResolvePixel(color.GetClearValue(), options);
+      for (uint32_t y = y0; y < y1; y++) {
+        std::fill(rows[y - y0] + x0, rows[y - y0] + x1, value);
+      }
+      return;
+    }
+    //源是按列存储的，8x8对齐的块里每列8个像素一定连续。整块转换到栈上转置，再按行连续写进Bitmap
+    uint32_t block[blockSize][blockSize];
+    for (uint32_t by = y0; by < y1; by += blockSize) {
+      const uint32_t countY = std::min(blockSize, y1 - by);
+      for (uint32_t bx = x0; bx < x1; bx += blockSize) {
+        const uint32_t countX = std::min(blockSize, x1 - bx);
+        for (uint32_t i = 0; i < countX; i++) {
+          ResolveRun(&color(bx + i, by), countY, options, block[i]);
+        }
+        for (uint32_t j = 0; j < countY; j++) {
+          uint32_t* dst = rows[by + j - y0] + bx;
+          for (uint32_t i = 0; i < countX; i++) {
+            dst[i] = block[i][j];
+          }
+        }
+      }
+    }
+  };
+  const size_t tileCount = size_t(tileCountX) * tileCountY;
+  if (workers == nullptr) {
+    for (size_t i = 0; i < tileCount; i++) {
+      task(i, 0);
+    }
+  } else {
+    workers->ParallelFor(tileCount, task);
+  }
+}
+
+//MSAA解析一次处理一列里连续的count个像素（最多8个，8x8块里的一列在两种布局下都是连续的）
+//把像素的RGBA当成连续的float数组，跨像素向量化，每个分量的加法顺序和逐像素时一样，结果逐位相同
+using ResolveColumnFunc = void (*)(const Color4f* const* samples, uint32_t sampleCount, uint32_t count, float invCount, Color4f* result);
+static void ResolveColumnScalar(const Color4f* const* samples, uint32_t sampleCount, uint32_t count, float invCount, Color4f* result) noexcept {
+  for (uint32_t j = 0; j < count; j++) {
+    Color4f sum = samples[0][j];
+    for (uint32_t s = 1; s < sampleCount; s++) {
+      sum = sum + samples[s][j];
+    }
+    result[j] = sum * invCount;
+  }
+}
+#if defined(HACKRI_SIMD_X86)
+static void ResolveColumnSse(const Color4f* const* samples, uint32_t sampleCount, uint32_t count, float invCount, Color4f* result) noexcept {
+  const __m128 scale = _mm_set1_ps(invCount);
+  float* dst = reinterpret_cast<float*>(result);
+  for (uint32_t i = 0; i < count * 4; i += 4) {
+    __m128 sum = _mm_loadu_ps(reinterpret_cast<const float*>(samples[0]) + i);
+    for (uint32_t s = 1; s < sampleCount; s++) {
+      sum = _mm_add_ps(sum, _mm_loadu_ps(reinterpret_cast<const float*>(samples[s]) + i));
+    }
+    _mm_storeu_ps(dst + i, _mm_mul_ps(sum, scale));
+  }
+}
+//一个寄存器是两个像素
+HACKRI_TARGET_AVX2 static void ResolveColumnAvx2(const Color4f* const* samples, uint32_t sampleCount, uint32_t count, float invCount, Color4f* result) noexcept {
+  const __m256 scale = _mm256_set1_ps(invCount);
+  float* dst = reinterpret_cast<float*>(result);
+  uint32_t i = 0;
+  for (; i + 8 <= count * 4; i += 8) {
+    __m256 sum = _mm256_loadu_ps(reinterpret_cast<const float*>(samples[0]) + i);
+    for (uint32_t s = 1; s < sampleCount; s++) {
+      sum = _mm256_add_ps(sum, _mm256_loadu_ps(reinterpret_cast<const float*>(samples[s]) + i));
+    }
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(sum, scale));
+  }
+  if (i < count * 4) {  //奇数个像素时剩下的一个
+    __m128 sum = _mm_loadu_ps(reinterpret_cast<const float*>(samples[0]) + i);
+    for (uint32_t s = 1; s < sampleCount; s++) {
+      sum = _mm_add_ps(sum, _mm_loadu_ps(reinterpret_cast<const float*>(samples[s]) + i));
+    }
+    _mm_storeu_ps(dst + i, _mm_mul_ps(sum, _mm256_castps256_ps128(scale)));
+  }
+}
+#endif
+static ResolveColumnFunc GetResolveColumnFunc() noexcept {
+  switch (GetSimdLevel()) {
+#if defined(HACKRI_SIMD_X86)
+    case SimdLevel::AVX2:
+      return ResolveColumnAvx2;
+    case SimdLevel::SSE2:
+      return ResolveColumnSse;
+#endif
+    default:
+      return ResolveColumnScalar;
+  }
+}
+
+void Renderer::Resolve(const MultisampleBuffer& source, Buffer2d<Color4f>& target, ThreadPool* workers) {
+  assert(source.GetWidth() == target.GetWidth() && source.GetHeight() == target.GetHeight());
+  constexpr uint32_t tileSize = Buffer2d<Color4f>::LAYOUT_TILE_SIZE;
+  constexpr uint32_t blockSize = Buffer2d<Color4f>::LAYOUT_BLOCK_SIZE;
+  const uint32_t width = source.GetWidth(), height = source.GetHeight();
+  const uint32_t sampleCount = source.GetSampleCount();
+  const uint32_t tileCountX = (width + tileSize - 1) / tileSize;
+  const uint32_t tileCountY = (height + tileSize - 1) / tileSize;
+  const float invCount = 1.0f / (float)sampleCount;
+  const Buffer2d<uint8_t>& uniformFlags = source.GetUniformFlags();
+  const ResolveColumnFunc resolveColumn = GetResolveColumnFunc();
+  auto task = [&](size_t tile, size_t) -> void {
+    const uint32_t x0 = uint32_t(tile / tileCountY) * tileSize, y0 = uint32_t(tile % tileCountY) * tileSize;
+    const uint32_t x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+    //待清除的检查每个tile只做一次，待清除的采样换成一列清除值
+    Color4f clearColumn[MultisampleBuffer::MAX_SAMPLE_COUNT][blockSize];
+    bool isPending[MultisampleBuffer::MAX_SAMPLE_COUNT];
+    for (uint32_t s = 0; s < sampleCount; s++) {
+      const Buffer2d<Color4f>& color = source.GetColor(s);
+      isPending[s] = color.IsPendingClear(x0, y0);
+      if (isPending[s]) {
+        std::fill(clearColumn[s], clearColumn[s] + blockSize, color.GetClearValue());
+      }
+    }
+    const bool isFlagsPending = uniformFlags.IsPendingClear(x0, y0);
+    const bool isAllUniform = isFlagsPending && uniformFlags.GetClearValue() != 0;
+    const Color4f* samples[MultisampleBuffer::MAX_SAMPLE_COUNT];
+    for (uint32_t x = x0; x < x1; x++) {
+      for (uint32_t by = y0; by < y1; by += blockSize) {
+        const uint32_t count = std::min(blockSize, y1 - by);
+        Color4f* dst = &target(x, by);
+        samples[0] = isPending[0] ? clearColumn[0] : &source.GetColor(0)(x, by);
+        //整列都是压缩的像素直接复制第0个采样
+        uint32_t uniform = (1u << count) - 1;
+        if (!isAllUniform) {
+          uniform = 0;
+          if (!isFlagsPending) {
+            const uint8_t* flags = &uniformFlags(x, by);
+            for (uint32_t j = 0; j < count; j++) {
+              uniform |= uint32_t(flags[j] != 0) << j;
+            }
+          }
+        }
+        if (uniform == (1u << count) - 1) {
+          std::copy(samples[0], samples[0] + count, dst);
+          continue;
+        }
+        for (uint32_t s = 1; s < sampleCount; s++) {
+          samples[s] = isPending[s] ? clearColumn[s] : &source.GetColor(s)(x, by);
+        }
+        resolveColumn(samples, sampleCount, count, invCount, dst);
+        //和展开的像素混在一起的压缩像素，其他采样里是旧的内容，重新复制
+        for (; uniform != 0; uniform &= uniform - 1) {
+          const int j = CountTrailingZero(uniform);
+          dst[j] = samples[0][j];
+        }
+      }
+    }
+  };
+  const size_t tileCount = size_t(tileCountX) * tileCountY;
+  if (workers == nullptr) {
+    for (size_t i = 0; i < tileCount; i++) {
+      task(i, 0);
+    }
+  } else {
+    workers->ParallelFor(tileCount, task);
+  }
+}
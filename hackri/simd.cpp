@@ -0,0 +1,50 @@
+#include <hackri/simd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace hackri;
+
+static SimdLevel DetectSimdLevel() noexcept {
+#if defined(HACKRI_SIMD_X86)
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  int maxId = info[0];
+  bool isAvx2 = false;
+  if (maxId >= 7) {
+    __cpuid(info, 1);
+    bool isOsxsave = (info[2] & (1 << 27)) != 0;
+    bool isAvx = (info[2] & (1 << 28)) != 0;
+    __cpuidex(info, 7, 0);
+    bool hasAvx2 = (info[1] & (1 << 5)) != 0;
+    //操作系统要保存ymm寄存器才能用
+    isAvx2 = isOsxsave && isAvx && hasAvx2 && (_xgetbv(0) & 0x6) == 0x6;
+  }
+  return isAvx2 ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#endif
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+SimdLevel hackri::GetSimdLevel() noexcept {
+  static const SimdLevel level = []() {
+    SimdLevel detect = DetectSimdLevel();
+    const char* env = std::getenv("HACKRI_SIMD");
+    if (env == nullptr) {
+      return detect;
+    }
+    SimdLevel request = detect;
+    if (std::strcmp(env, "scalar") == 0) {
+      request = SimdLevel::Scalar;
+    } else if (std::strcmp(env, "sse2") == 0) {
+      request = SimdLevel::SSE2;
+    }
+    return request < detect ? request : detect;
+  }();
+  return level;
+}
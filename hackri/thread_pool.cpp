@@ -0,0 +1,76 @@
+#include <hackri/thread_pool.h>
+
+using namespace hackri;
+
+ThreadPool::ThreadPool(size_t threadCount) {
+  size_t workerCount = threadCount > 1 ? threadCount - 1 : 0;
+  _threads.reserve(workerCount);
+  for (size_t i = 0; i < workerCount; i++) {
+    _threads.emplace_back([this, i]() { WorkerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _isExit = true;
+  }
+  _wakeCv.notify_all();
+  for (auto& t : _threads) {
+    t.join();
+  }
+}
+
+void ThreadPool::ParallelFor(size_t count, const Task& task) {
+  if (count == 0) {
+    return;
+  }
+  if (_threads.empty()) {
+    _next = 0;
+    RunTasks(task, count, 0);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _task = &task;
+    _count = count;
+    _next = 0;
+    _busy = _threads.size();
+    _generation++;
+  }
+  _wakeCv.notify_all();
+  RunTasks(task, count, _threads.size());  //调用者是最后一个工作线程
+  std::unique_lock<std::mutex> lock(_mutex);
+  _doneCv.wait(lock, [this]() { return _busy == 0; });
+  _task = nullptr;
+}
+
+void ThreadPool::WorkerLoop(size_t worker) {
+  uint64_t generation = 0;
+  while (true) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _wakeCv.wait(lock, [&]() { return _isExit || _generation != generation; });
+    if (_isExit) {
+      return;
+    }
+    generation = _generation;
+    const Task* task = _task;
+    size_t count = _count;
+    lock.unlock();
+    RunTasks(*task, count, worker);
+    lock.lock();
+    if (--_busy == 0) {
+      _doneCv.notify_one();
+    }
+  }
+}
+
+void ThreadPool::RunTasks(const Task& task, size_t count, size_t worker) {
+  while (true) {
+    size_t index = _next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= count) {
+      break;
+    }
+    task(index, worker);
+  }
+}
@@ -0,0 +1,217 @@
+#include <hackri/renderer.h>
+#include <hackri/rasterizer.h>
+#include <hackri/pipeline.h>
+
+#include <cassert>
+#include <algorithm>
+
+using namespace hackri;
+
+//一个draw的post-transform cache，按顶点编号直接寻址
+struct VisibilityVertexCache {
+  Span<Vector4f> Pos;
+  Span<uint8_t> Out;
+};
+//可见性缓冲里的一个三角形，重建重心坐标需要的东西
+struct VisibilityTriangle {
+  uint64_t ID;
+  const VertexShaderOutLayout* Layout;
+  Vector3f Edge[3];    //裁剪空间(x, y, w)两两的叉积，Edge[i]对着顶点i
+  float W[3];
+  const float* Out[3];  //三个顶点的VS输出，Out[0]是provoking vertex
+};
+
+//每个被引用的顶点运行一次VS，和DrawIndexed的缓存一样
+static VisibilityVertexCache TransformVisibilityDraw(
+    const PipelineInput& input, const VisibilityDraw& draw, PipelineMemory& memory) {
+  const PipelineState& pso = *draw.PSO;
+  const size_t vsOutSize = pso.OutLayout.Size;
+  VisibilityVertexCache cache;
+  if (draw.IndexCount == 0) {
+    return cache;
+  }
+  const size_t vertexCount = *std::max_element(draw.Indices, draw.Indices + draw.IndexCount) + 1;
+  cache.Pos = memory.AllocToSpan<Vector4f>(vertexCount);
+  cache.Out = memory.AllocToSpan<uint8_t>(vertexCount * vsOutSize);
+  Span<bool> isReferenced = memory.AllocToSpan<bool>(vertexCount);
+  isReferenced.Fill(false);
+  for (size_t i = 0; i < draw.IndexCount; i++) {
+    isReferenced[draw.Indices[i]] = true;
+  }
+  if (pso.VSBatch) {
+    PipelineInput drawInput = input;
+    drawInput.Vertex = draw.Vertex;
+    drawInput.CBuffer = draw.CBuffer;
+    TransformVertexBatches(drawInput, pso, memory, vertexCount, isReferenced, cache.Pos, cache.Out, pso.VSBatch);
+    return cache;
+  }
+  for (size_t i = 0; i < vertexCount; i++) {
+    if (!isReferenced[i]) {
+      continue;
+    }
+    VertexShaderParams vsParam{draw.Vertex + i * pso.VertexSize,
+                               {cache.Out.GetPointer() + i * vsOutSize, nullptr, nullptr},
+                               draw.CBuffer};
+    cache.Pos[i] = pso.VS(0, vsParam);
+  }
+  return cache;
+}
+//像素中心在NDC下是q = (u, v, 1)，透视矫正的重心坐标正比于q和另外两个顶点的(x, y, w)组成的行列式
+//也就是q · Edge[i]。三角形的w有正有负也成立，所以不需要知道第一遍怎么裁剪的（Olano and Greer 1997）
+//屏幕空间线性的重心坐标正比于透视矫正的重心坐标乘w
+//结果的第k个float写到result[k * stride]
+static void InterpolateVisibility(const VisibilityTriangle& tri, float u, float v, float* result, size_t stride) noexcept {
+  float persp[3], screen[3];
+  for (int i = 0; i < 3; i++) {
+    persp[i] = tri.Edge[i].X() * u + tri.Edge[i].Y() * v + tri.Edge[i].Z();
+  }
+  const float invSum = 1.0f / (persp[0] + persp[1] + persp[2]);
+  for (int i = 0; i < 3; i++) {
+    persp[i] *= invSum;
+    screen[i] = persp[i] * tri.W[i];
+  }
+  const float invScreenSum = 1.0f / (screen[0] + screen[1] + screen[2]);
+  for (int i = 0; i < 3; i++) {
+    screen[i] *= invScreenSum;
+  }
+  tri.Layout->ForEachSegment([&](size_t begin, size_t end, Interpolation mode) {
+    const float* weight = mode == Interpolation::NoPerspective ? screen : persp;
+    for (size_t k = begin; k < end; k++) {
+      if (mode == Interpolation::Flat) {
+        result[k * stride] = tri.Out[0][k];
+      } else {
+        result[k * stride] = tri.Out[0][k] * weight[0] + tri.Out[1][k] * weight[1] + tri.Out[2][k] * weight[2];
+      }
+    }
+  });
+}
+
+void Renderer::ShadeVisibility(
+    const PipelineInput& input,
+    const VisibilityDraw* draws, size_t drawCount,
+    PipelineMemory& memory) {
+  //ColorTarget只会写ColorBuffer或PackedColorBuffer，不支持MSAA的目标
+  assert(input.VisibilityBuffer != nullptr && input.Multisample == nullptr &&
+         (input.ColorBuffer != nullptr || input.PackedColorBuffer != nullptr));
+  const Buffer2d<uint64_t>& ids = *input.VisibilityBuffer;
+  const uint32_t width = input.FrameWidth, height = input.FrameHeight;
+  //先把所有draw的顶点变换好，着色时只读
+  Span<VisibilityVertexCache> caches = memory.AllocToSpan<VisibilityVertexCache>(drawCount);
+  Span<OutputMergeFunc> merges = memory.AllocToSpan<OutputMergeFunc>(drawCount);
+  size_t maxFloatCnt = 1;
+  for (size_t i = 0; i < drawCount; i++) {
+    caches[i] = TransformVisibilityDraw(input, draws[i], memory);
+    merges[i] = GetOutputMergeFunc<BlendFromPSO>(*draws[i].PSO);
+    maxFloatCnt = std::max(maxFloatCnt, draws[i].PSO->OutLayout.Size / sizeof(float));
+  }
+  auto setup = [&](uint64_t id, VisibilityTriangle& tri) -> void {
+    if (tri.ID == id) {  //相邻像素大多是同一个三角形
+      return;
+    }
+    const uint32_t drawID = GetVisibilityDraw(id);
+    const size_t primitive = GetVisibilityPrimitive(id);
+    assert(drawID < drawCount && primitive * 3 < draws[drawID].IndexCount);
+    const VisibilityDraw& draw = draws[drawID];
+    const VisibilityVertexCache& cache = caches[drawID];
+    const size_t vsOutSize = draw.PSO->OutLayout.Size;
+    Vector3f clip[3];
+    for (int i = 0; i < 3; i++) {
+      const size_t index = draw.Indices[primitive * 3 + i];
+      const Vector4f& pos = cache.Pos[index];
+      clip[i] = Vector3f(pos.X(), pos.Y(), pos.W());
+      tri.W[i] = pos.W();
+      tri.Out[i] = reinterpret_cast<const float*>(cache.Out.GetPointer() + index * vsOutSize);
+    }
+    tri.Edge[0] = Cross(clip[1], clip[2]);
+    tri.Edge[1] = Cross(clip[2], clip[0]);
+    tri.Edge[2] = Cross(clip[0], clip[1]);
+    tri.Layout = &draw.PSO->OutLayout;
+    tri.ID = id;
+  };
+  //按tile着色，一次处理一列8个像素，同一个draw的像素交给批量PS一起算
+  constexpr uint32_t tileSize = TILE_SIZE;
+  const uint32_t tileCountX = (width + tileSize - 1) / tileSize;
+  const uint32_t tileCountY = (height + tileSize - 1) / tileSize;
+  const size_t workerCount = memory.Workers == nullptr ? 1 : memory.Workers->GetWorkerCount();
+  const size_t scratchCount = maxFloatCnt * PIXEL_BATCH_SIZE;
+  Span<float> scratch = memory.AllocToSpan<float>(scratchCount * workerCount, 32);
+  auto task = [&](size_t tile, size_t worker) -> void {
+    const uint32_t x0 = uint32_t(tile / tileCountY) * tileSize, y0 = uint32_t(tile % tileCountY) * tileSize;
+    const uint32_t x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+    if (ids.IsPendingClear(x0, y0) && ids.GetClearValue() == VISIBILITY_EMPTY) {
+      return;
+    }
+    float* pixelInput = scratch.GetPointer() + worker * scratchCount;
+    ColorTarget colorTarget(input);
+    VisibilityTriangle tri{};
+    tri.ID = VISIBILITY_EMPTY;
+    for (uint32_t x = x0; x < x1; x++) {
+      const float u = ((float)x + 0.5f) / (float)width * 2.0f - 1.0f;
+      for (uint32_t by = y0; by < y1; by += PIXEL_BATCH_SIZE) {
+        const uint32_t count = std::min(uint32_t(PIXEL_BATCH_SIZE), y1 - by);
+        uint64_t column[PIXEL_BATCH_SIZE];
+        uint32_t remain = 0;
+        for (uint32_t j = 0; j < count; j++) {
+          column[j] = ids(x, by + j);
+          remain |= column[j] != VISIBILITY_EMPTY ? 1u << j : 0u;
+        }
+        while (remain != 0) {
+          //这一列里属于同一个draw的像素
+          const uint32_t drawID = GetVisibilityDraw(column[CountTrailingZero(remain)]);
+          uint32_t mask = 0;
+          for (uint32_t live = remain; live != 0; live &= live - 1) {
+            const int j = CountTrailingZero(live);
+            mask |= GetVisibilityDraw(column[j]) == drawID ? 1u << j : 0u;
+          }
+          remain &= ~mask;
+          const VisibilityDraw& draw = draws[drawID];
+          const PipelineState& pso = *draw.PSO;
+          Color4f colors[PIXEL_BATCH_SIZE];
+          uint32_t shaded = 0;
+          if (pso.PSBatch) {
+            for (uint32_t live = mask; live != 0; live &= live - 1) {
+              const int j = CountTrailingZero(live);
+              setup(column[j], tri);
+              const float v = ((float)(by + j) + 0.5f) / (float)height * 2.0f - 1.0f;
+              InterpolateVisibility(tri, u, v, pixelInput + j, PIXEL_BATCH_SIZE);
+            }
+            PixelBatchParams psParam{pixelInput, draw.CBuffer, mask, x, by};
+            PixelBatchResult result;
+            result.Discard = 0;
+            pso.PSBatch(psParam, result);
+            shaded = mask & ~result.Discard;
+            for (uint32_t live = shaded; live != 0; live &= live - 1) {
+              const int j = CountTrailingZero(live);
+              colors[j] = result.GetColor(j);
+            }
+          } else {
+            PixelShaderParams psParam{reinterpret_cast<const uint8_t*>(pixelInput), draw.CBuffer};
+            for (uint32_t live = mask; live != 0; live &= live - 1) {
+              const int j = CountTrailingZero(live);
+              setup(column[j], tri);
+              const float v = ((float)(by + j) + 0.5f) / (float)height * 2.0f - 1.0f;
+              InterpolateVisibility(tri, u, v, pixelInput, 1);
+              bool isDiscard = false;
+              Color4f src = pso.PS(psParam, isDiscard);
+              if (!isDiscard) {
+                colors[j] = src;
+                shaded |= 1u << j;
+              }
+            }
+          }
+          if (shaded != 0) {
+            merges[drawID](pso, colorTarget, x, by, shaded, colors);
+          }
+        }
+      }
+    }
+  };
+  const size_t tileCount = size_t(tileCountX) * tileCountY;
+  if (memory.Workers == nullptr) {
+    for (size_t i = 0; i < tileCount; i++) {
+      task(i, 0);
+    }
+  } else {
+    memory.Workers->ParallelFor(tileCount, task);
+  }
+}
@@ -8,6 +8,7 @@
 #include <functional>
 #include <ostream>
 #include <initializer_list>
+#include <hackri/math_util.h>
 
 namespace hackri {
 template <class T, size_t N>
@@ -17,12 +18,12 @@ class Array {
 
   using ThisType = Array<T, N>;
   using ContainerType = T[N];
-  using ValueType = typename T;
-  using SizeType = typename size_t;
-  using Reference = typename T&;
-  using ConstReference = typename const T&;
-  using Iterator = typename T*;
-  using ConstIterator = typename const T*;
+  using ValueType = T;
+  using SizeType = size_t;
+  using Reference = T&;
+  using ConstReference = const T&;
+  using Iterator = T*;
+  using ConstIterator = const T*;
 
   constexpr static SizeType ContainerSize = N;
 
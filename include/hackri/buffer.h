@@ -2,51 +2,376 @@
 #define __HACKRI_BUFFER_H__
 
 #include <hackri/color.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <type_traits>
 #include <vector>
 
 namespace hackri {
+//Buffer2d的存储布局，不管哪种布局，8x8对齐的块里每一列的8个像素都是连续的（光栅化按列读写深度依赖这一点）
+enum class BufferLayout {
+  Linear,  //按列存储，下标是i * pitch + j，pitch是补齐后的列长度
+  Tiled    //64x64的tile按列排列，tile内的8x8块按Morton顺序排列，块内按列存储，宽高会补齐到64的倍数
+};
+struct BufferOptions {
+  BufferLayout Layout = BufferLayout::Linear;
+  bool IsInitialize = true;   //为false时不初始化内容，适合马上就会Fill的渲染目标
+  bool IsPadColumn = false;   //Linear布局下列间距是1KB的整数倍时多补一个cache line，避免相邻列落在同一组cache set上
+  bool IsHugePage = false;    //大于2MB时按2MB对齐并用透明大页（Linux上是madvise(MADV_HUGEPAGE)，其他平台忽略）
+};
+//Buffer2d的内存，起点至少按BUFFER_ALIGNMENT对齐，分配失败时抛出std::bad_alloc
+constexpr size_t BUFFER_ALIGNMENT = 64;
+void* AllocateBufferMemory(size_t size, bool isHugePage);
+void FreeBufferMemory(void* ptr) noexcept;
+
+//二维缓冲，i是x，j是y
+//Fill是快速清除：只记下清除值并把每个64x64的tile标记为待清除，读待清除的tile直接得到清除值，
+//第一次通过非const的接口访问时才真正写入这个tile。多个线程同时访问时必须各自访问不同的tile（分块光栅化满足这一点）
 template <class T>
 class Buffer2d {
  public:
-  Buffer2d(uint32_t width, uint32_t height) noexcept
-      : _width(width), _height(height) {
-    _buffer = std::vector<T>(size_t(width) * height, T());
+  constexpr static uint32_t LAYOUT_BLOCK_SIZE = 8;
+  constexpr static uint32_t LAYOUT_TILE_SIZE = 64;
+
+  //分配内存的构造函数在分配失败时抛出std::bad_alloc
+  Buffer2d(uint32_t width, uint32_t height, const BufferOptions& options = {})
+      : _width(width), _height(height), _layout(options.Layout) {
+    Allocate(options);
+    if (options.IsInitialize) {
+      std::uninitialized_value_construct_n(_data, _count);
+    } else {
+      std::uninitialized_default_construct_n(_data, _count);
+    }
+  }
+  Buffer2d(uint32_t width, uint32_t height, BufferLayout layout)
+      : Buffer2d(width, height, BufferOptions{layout}) {}
+  //ptr是按列连续存储的width * height个元素
+  Buffer2d(uint32_t width, uint32_t height, const T* ptr)
+      : Buffer2d(width, height, BufferOptions{BufferLayout::Linear, false}) {
+    for (uint32_t i = 0; i < width; i++) {
+      std::copy(ptr + size_t(i) * height, ptr + size_t(i + 1) * height, _data + size_t(i) * _pitch);
+    }
+  }
+  Buffer2d(const Buffer2d& other)
+      : _width(other._width), _height(other._height), _layout(other._layout),
+        _isTilePending(other._isTilePending), _clearValue(other._clearValue) {
+    AllocateLike(other);
+    std::uninitialized_copy_n(other._data, _count, _data);
   }
-  Buffer2d(uint32_t width, uint32_t height, const T* ptr) noexcept
-      : _width(width), _height(height) {
-    auto length = size_t(width) * height;
-    _buffer.reserve(length);
-    std::copy(ptr, ptr + length, _buffer.begin());
+  Buffer2d(Buffer2d&& other) noexcept
+      : _width(other._width), _height(other._height), _layout(other._layout),
+        _pitch(other._pitch), _tileCountY(other._tileCountY),
+        _count(other._count), _isHugePage(other._isHugePage), _data(other._data),
+        _isTilePending(std::move(other._isTilePending)), _clearValue(other._clearValue) {
+    other._data = nullptr;
+    other._count = 0;
+  }
+  Buffer2d& operator=(Buffer2d other) noexcept {
+    std::swap(_width, other._width);
+    std::swap(_height, other._height);
+    std::swap(_layout, other._layout);
+    std::swap(_pitch, other._pitch);
+    std::swap(_tileCountY, other._tileCountY);
+    std::swap(_count, other._count);
+    std::swap(_isHugePage, other._isHugePage);
+    std::swap(_data, other._data);
+    std::swap(_isTilePending, other._isTilePending);
+    std::swap(_clearValue, other._clearValue);
+    return *this;
+  }
+  ~Buffer2d() noexcept {
+    if (_data != nullptr) {
+      std::destroy_n(_data, _count);
+      FreeBufferMemory(_data);
+    }
   }
 
   constexpr uint32_t GetWidth() const noexcept { return _width; }
   constexpr uint32_t GetHeight() const noexcept { return _height; }
+  constexpr BufferLayout GetLayout() const noexcept { return _layout; }
   T& operator()(uint32_t i, uint32_t j) {
-    return _buffer[size_t(i) * GetHeight() + j];
+    const size_t tile = GetTileIndex(i, j);
+    if (_isTilePending[tile]) {
+      MaterializeTile(tile);
+    }
+    return _data[GetIndex(i, j)];
   }
   const T& operator()(uint32_t i, uint32_t j) const {
-    return _buffer[size_t(i) * GetHeight() + j];
+    return _isTilePending[GetTileIndex(i, j)] ? _clearValue : _data[GetIndex(i, j)];
   }
 
+  //只标记所有tile，开销和tile数成正比
   void Fill(T value) noexcept {
-    std::fill(_buffer.begin(), _buffer.end(), value);
+    _clearValue = value;
+    std::fill(_isTilePending.begin(), _isTilePending.end(), uint8_t(1));
+  }
+  //(i, j)所在的tile自上次Fill以来还没写入过，内容全是GetClearValue()
+  bool IsPendingClear(uint32_t i, uint32_t j) const noexcept { return _isTilePending[GetTileIndex(i, j)] != 0; }
+  const T& GetClearValue() const noexcept { return _clearValue; }
+  //按tile、按存储顺序访问所有像素，func(i, j, value)，整屏处理（resolve之类）时比逐个调用operator()快
+  //const版本遇到待清除的tile时传入清除值，不会写入内存
+  template <class Func>
+  void ForEach(Func&& func) {
+    ForEachImpl(*this, func);
+  }
+  template <class Func>
+  void ForEach(Func&& func) const {
+    ForEachImpl(*this, func);
   }
 
  private:
+  //tile内8x8块的Morton编号，x在偶数位
+  static constexpr uint32_t MortonBlock(uint32_t bx, uint32_t by) noexcept {
+    auto spread = [](uint32_t v) { return (v & 1) | ((v & 2) << 1) | ((v & 4) << 2); };
+    return spread(bx) | (spread(by) << 1);
+  }
+  size_t GetTileIndex(uint32_t i, uint32_t j) const noexcept {
+    return size_t(i / LAYOUT_TILE_SIZE) * _tileCountY + j / LAYOUT_TILE_SIZE;
+  }
+  size_t GetIndex(uint32_t i, uint32_t j) const noexcept {
+    if (_layout == BufferLayout::Linear) {
+      return size_t(i) * _pitch + j;
+    }
+    size_t tile = GetTileIndex(i, j);
+    uint32_t block = MortonBlock((i / LAYOUT_BLOCK_SIZE) % 8, (j / LAYOUT_BLOCK_SIZE) % 8);
+    constexpr size_t blockPerTile = (LAYOUT_TILE_SIZE / LAYOUT_BLOCK_SIZE) * (LAYOUT_TILE_SIZE / LAYOUT_BLOCK_SIZE);
+    size_t blockStart = (tile * blockPerTile + block) * LAYOUT_BLOCK_SIZE * LAYOUT_BLOCK_SIZE;
+    return blockStart + (i % LAYOUT_BLOCK_SIZE) * LAYOUT_BLOCK_SIZE + j % LAYOUT_BLOCK_SIZE;
+  }
+  //把待清除的tile真正写成清除值
+  void MaterializeTile(size_t tile) noexcept {
+    if (_layout == BufferLayout::Tiled) {
+      T* start = _data + tile * LAYOUT_TILE_SIZE * LAYOUT_TILE_SIZE;
+      std::fill(start, start + LAYOUT_TILE_SIZE * LAYOUT_TILE_SIZE, _clearValue);
+    } else {
+      const uint32_t x0 = uint32_t(tile / _tileCountY) * LAYOUT_TILE_SIZE;
+      const uint32_t y0 = uint32_t(tile % _tileCountY) * LAYOUT_TILE_SIZE;
+      const uint32_t x1 = std::min(x0 + LAYOUT_TILE_SIZE, _width);
+      const uint32_t y1 = std::min(y0 + LAYOUT_TILE_SIZE, _height);
+      for (uint32_t x = x0; x < x1; x++) {
+        std::fill(_data + size_t(x) * _pitch + y0, _data + size_t(x) * _pitch + y1, _clearValue);
+      }
+    }
+    _isTilePending[tile] = 0;
+  }
+  void Allocate(const BufferOptions& options) {
+    _tileCountY = (_height + LAYOUT_TILE_SIZE - 1) / LAYOUT_TILE_SIZE;
+    const size_t tileCountX = (_width + LAYOUT_TILE_SIZE - 1) / LAYOUT_TILE_SIZE;
+    _isTilePending.assign(tileCountX * _tileCountY, uint8_t(0));
+    _pitch = _height;
+    if (_layout == BufferLayout::Tiled) {
+      _count = tileCountX * _tileCountY * LAYOUT_TILE_SIZE * LAYOUT_TILE_SIZE;
+    } else {
+      //每列的起点都按cache line对齐，元素大小不能整除cache line的时候做不到，就不补齐
+      if constexpr (BUFFER_ALIGNMENT % sizeof(T) == 0) {
+        constexpr size_t lineCount = BUFFER_ALIGNMENT / sizeof(T);
+        _pitch = (_height + lineCount - 1) / lineCount * lineCount;
+        if (options.IsPadColumn && (_pitch * sizeof(T)) % 1024 == 0) {
+          _pitch += lineCount;
+        }
+      }
+      _count = size_t(_width) * _pitch;
+    }
+    _isHugePage = options.IsHugePage;
+    _data = reinterpret_cast<T*>(AllocateBufferMemory(std::max(_count, size_t(1)) * sizeof(T), _isHugePage));
+  }
+  void AllocateLike(const Buffer2d& other) {
+    _pitch = other._pitch;
+    _tileCountY = other._tileCountY;
+    _count = other._count;
+    _isHugePage = other._isHugePage;
+    _data = reinterpret_cast<T*>(AllocateBufferMemory(std::max(_count, size_t(1)) * sizeof(T), _isHugePage));
+  }
+  template <class Self, class Func>
+  static void ForEachImpl(Self& self, Func& func) {
+    const uint32_t width = self._width, height = self._height;
+    for (uint32_t tx = 0; tx < width; tx += LAYOUT_TILE_SIZE) {
+      for (uint32_t ty = 0; ty < height; ty += LAYOUT_TILE_SIZE) {
+        //补齐的部分不访问
+        const uint32_t tx1 = std::min(tx + LAYOUT_TILE_SIZE, width);
+        const uint32_t ty1 = std::min(ty + LAYOUT_TILE_SIZE, height);
+        const size_t tile = self.GetTileIndex(tx, ty);
+        if (self._isTilePending[tile]) {
+          if constexpr (std::is_const_v<Self>) {
+            for (uint32_t i = tx; i < tx1; i++) {
+              for (uint32_t j = ty; j < ty1; j++) {
+                func(i, j, self._clearValue);
+              }
+            }
+            continue;
+          } else {
+            self.MaterializeTile(tile);
+          }
+        }
+        if (self._layout == BufferLayout::Linear) {
+          for (uint32_t i = tx; i < tx1; i++) {
+            auto* column = self._data + size_t(i) * self._pitch;
+            for (uint32_t j = ty; j < ty1; j++) {
+              func(i, j, column[j]);
+            }
+          }
+          continue;
+        }
+        for (uint32_t x0 = tx; x0 < tx1; x0 += LAYOUT_BLOCK_SIZE) {
+          for (uint32_t y0 = ty; y0 < ty1; y0 += LAYOUT_BLOCK_SIZE) {
+            const uint32_t columnCount = std::min(LAYOUT_BLOCK_SIZE, tx1 - x0);
+            const uint32_t rowCount = std::min(LAYOUT_BLOCK_SIZE, ty1 - y0);
+            auto* block = self._data + self.GetIndex(x0, y0);
+            for (uint32_t c = 0; c < columnCount; c++) {
+              for (uint32_t r = 0; r < rowCount; r++) {
+                func(x0 + c, y0 + r, block[c * LAYOUT_BLOCK_SIZE + r]);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
   uint32_t _width;
   uint32_t _height;
-  std::vector<T> _buffer;
+  BufferLayout _layout;
+  size_t _pitch;         //Linear布局时相邻两列的间距（元素个数）
+  uint32_t _tileCountY;  //Tiled布局时y方向的tile数
+  size_t _count;         //包括补齐部分的元素个数
+  bool _isHugePage;
+  T* _data;
+  std::vector<uint8_t> _isTilePending;  //每个64x64的tile是否待清除，按x优先排列
+  T _clearValue{};
 };
 
 class ColorBuffer : public Buffer2d<Color4f> {
  public:
-  ColorBuffer(uint32_t width, uint32_t height) noexcept;
-  ColorBuffer(uint32_t width, uint32_t height, const Color4f* ptr) noexcept;
+  ColorBuffer(uint32_t width, uint32_t height, const BufferOptions& options = {});
+  ColorBuffer(uint32_t width, uint32_t height, const Color4f* ptr);
 };
 class DepthBuffer : public Buffer2d<float> {
  public:
-  DepthBuffer(uint32_t width, uint32_t height) noexcept;
-  DepthBuffer(uint32_t width, uint32_t height, const float* ptr) noexcept;
+  DepthBuffer(uint32_t width, uint32_t height, const BufferOptions& options = {});
+  DepthBuffer(uint32_t width, uint32_t height, const float* ptr);
+};
+//深度缓冲的存储格式由元素类型决定：float是D32F，uint16_t是D16，uint32_t是D24（高8位必须是0）
+//深度测试直接比较存储值，Encode把[0, 1]的深度量化成存储值，Decode反过来
+//QUANTUM是量化误差的上界，Hi-Z用它把存储值还原成保守的范围
+template <class T>
+struct DepthFormat;
+template <>
+struct DepthFormat<float> {
+  constexpr static float QUANTUM = 0.0f;
+  static float Encode(float depth) noexcept { return depth; }
+  static constexpr float Decode(float value) noexcept { return value; }
+};
+template <>
+struct DepthFormat<uint16_t> {
+  constexpr static float MAX_VALUE = 65535.0f;
+  constexpr static float QUANTUM = 1.0f / MAX_VALUE;
+  static uint16_t Encode(float depth) noexcept {
+    return (uint16_t)std::lrint(std::clamp(depth, 0.0f, 1.0f) * MAX_VALUE);
+  }
+  static constexpr float Decode(uint16_t value) noexcept { return value / MAX_VALUE; }
+};
+template <>
+struct DepthFormat<uint32_t> {
+  constexpr static float MAX_VALUE = 16777215.0f;
+  constexpr static float QUANTUM = 1.0f / MAX_VALUE;
+  static uint32_t Encode(float depth) noexcept {
+    return (uint32_t)std::lrint(std::clamp(depth, 0.0f, 1.0f) * MAX_VALUE);
+  }
+  static constexpr float Decode(uint32_t value) noexcept { return value / MAX_VALUE; }
+};
+
+//分层深度（Hi-Z），记录每个8x8块和每个64x64块内深度的最小值、最大值，光栅化时用来整块剔除
+//必须和对应的深度缓冲保持同步：深度缓冲Fill的时候也要Fill同样的值，或者之后调用Build
+//绘制时Renderer会随着深度写入增量更新
+//UpdateBlock、GetCoarse会改写共享的状态，多线程光栅化时每个64x64块只能由负责它的那个光栅化tile访问
+//（COARSE_SIZE和TILE_SIZE相同，一个tile正好对应一个64x64块），不同的64x64块之间互不影响
+class HiZBuffer {
+ public:
+  constexpr static uint32_t BLOCK_SIZE = 8;
+  constexpr static uint32_t COARSE_SIZE = 64;
+  using Range = Array<float, 2>;  //{min, max}
+
+  HiZBuffer(uint32_t width, uint32_t height);
+
+  constexpr uint32_t GetWidth() const noexcept { return _width; }
+  constexpr uint32_t GetHeight() const noexcept { return _height; }
+
+  //范围总是用[0, 1]的浮点深度记录，D16/D24的存储值会解码并按量化误差放宽
+  //不是快速清除，会马上写满所有块，之后多个线程同时更新不同的64x64块是安全的
+  void Fill(float value) noexcept;
+  //从深度缓冲完整重建
+  template <class T>
+  void Build(const Buffer2d<T>& depth) noexcept;
+  //(bx, by)块内的深度有写入，重新统计这个块
+  template <class T>
+  void UpdateBlock(const Buffer2d<T>& depth, uint32_t bx, uint32_t by) noexcept;
+  //(x, y)像素写入了存储值value，只扩大范围不重新统计，结果依然是保守的
+  template <class T>
+  void Expand(uint32_t x, uint32_t y, T value) noexcept;
+  const Range& GetBlock(uint32_t bx, uint32_t by) const noexcept { return _block(bx, by); }
+  //64x64块的范围在需要的时候才从8x8块重新统计，所以不是const，调用者必须是这个64x64块的所有者
+  const Range& GetCoarse(uint32_t cx, uint32_t cy) noexcept;
+
+ private:
+  uint32_t _width;
+  uint32_t _height;
+  Buffer2d<Range> _block;
+  Buffer2d<Range> _coarse;
+  Buffer2d<uint8_t> _isCoarseDirty;
+};
+//多重采样（MSAA）的渲染目标，每个像素有4个或8个采样，深度每个采样一份
+//颜色按像素压缩：所有采样颜色相同的像素（IsUniform）只存在第0个采样里，
+//只有三角形边缘这种部分采样被覆盖的像素才展开成每个采样一份
+class MultisampleBuffer {
+ public:
+  constexpr static uint32_t MAX_SAMPLE_COUNT = 8;
+
+  //sampleCount只能是4或8，options用于每个采样的颜色和深度
+  MultisampleBuffer(uint32_t width, uint32_t height, uint32_t sampleCount, const BufferOptions& options = {});
+
+  constexpr uint32_t GetWidth() const noexcept { return _width; }
+  constexpr uint32_t GetHeight() const noexcept { return _height; }
+  constexpr uint32_t GetSampleCount() const noexcept { return _sampleCount; }
+  //所有采样都清除成同样的颜色和深度，只有第0个采样的颜色和每个采样的深度需要快速清除
+  void Fill(const Color4f& color, float depth) noexcept;
+  Buffer2d<float>& GetDepth(uint32_t sample) noexcept { return _depth[sample]; }
+  const Buffer2d<float>& GetDepth(uint32_t sample) const noexcept { return _depth[sample]; }
+  //第sample个采样的颜色，压缩的像素只有第0个有意义
+  Buffer2d<Color4f>& GetColor(uint32_t sample) noexcept { return _color[sample]; }
+  const Buffer2d<Color4f>& GetColor(uint32_t sample) const noexcept { return _color[sample]; }
+  bool IsUniform(uint32_t x, uint32_t y) const noexcept { return _isUniform(x, y) != 0; }
+  //每个像素是否压缩（非0），和采样用同样的布局，整块处理时用来检查待清除的tile
+  const Buffer2d<uint8_t>& GetUniformFlags() const noexcept { return _isUniform; }
+  //(x, y)第sample个采样的颜色
+  const Color4f& GetSample(uint32_t x, uint32_t y, uint32_t sample) const noexcept {
+    return _color[IsUniform(x, y) ? 0 : sample](x, y);
+  }
+  //所有采样写同一个颜色，像素重新变成压缩的
+  void StoreUniform(uint32_t x, uint32_t y, const Color4f& color) noexcept {
+    _color[0](x, y) = color;
+    _isUniform(x, y) = 1;
+  }
+  //压缩的像素展开成每个采样一份，之后可以单独写某个采样
+  void Expand(uint32_t x, uint32_t y) noexcept {
+    if (!IsUniform(x, y)) {
+      return;
+    }
+    const Color4f color = _color[0](x, y);
+    for (uint32_t i = 1; i < _sampleCount; i++) {
+      _color[i](x, y) = color;
+    }
+    _isUniform(x, y) = 0;
+  }
+
+ private:
+  uint32_t _width;
+  uint32_t _height;
+  uint32_t _sampleCount;
+  std::vector<Buffer2d<float>> _depth;
+  std::vector<Buffer2d<Color4f>> _color;
+  Buffer2d<uint8_t> _isUniform;
 };
 }  // namespace hackri
 
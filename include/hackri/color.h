@@ -102,6 +102,25 @@ class Color4b : public Array<uint8_t, 4> {
   uint32_t ToInt32BGRA() const noexcept;
   uint32_t ToInt32RGBA() const noexcept;
 };
+//打包成32位的颜色格式，R在最低位
+enum class ColorFormat {
+  RGBA8Unorm,   //每个通道8位
+  RGBA8Srgb,    //RGB按sRGB编码存储，读出来是线性的，A依然是线性的
+  RGB10A2Unorm  //RGB各10位，A 2位
+};
+uint32_t PackColor(const Color4f& color, ColorFormat format) noexcept;
+//线性值编码成8位sRGB，结果和先ToSrgb再四舍五入一样（用精确的分界值查表）
+uint8_t EncodeSrgb8(float linear) noexcept;
+//EncodeSrgb8用的查找表，批量的SIMD实现直接用它，结果和EncodeSrgb8一样
+//[0, 1]内的线性值先查code = Bucket[min((int)(linear * SRGB_BUCKET_COUNT), SRGB_BUCKET_COUNT - 1)]，
+//linear不小于Threshold[code]时再加1
+constexpr int SRGB_BUCKET_COUNT = 4096;
+struct SrgbEncodeTable {
+  float Threshold[256];               //线性值不小于Threshold[k]时编码值至少是k+1，最后一个是哨兵
+  uint8_t Bucket[SRGB_BUCKET_COUNT];  //1/4096区间起点的编码值，相邻两个阈值的间距都大于1/4096，所以最多再进一位
+};
+const SrgbEncodeTable& GetSrgbEncodeTable() noexcept;
+Color4f UnpackColor(uint32_t packed, ColorFormat format) noexcept;
 }  // namespace hackri
 
 #endif
\ No newline at end of file
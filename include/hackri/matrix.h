@@ -53,7 +53,7 @@ class Matrix {
   constexpr void SetRow(size_t row, const PacketType& arr) noexcept { _data.Use[row] = arr; }
   constexpr void SetColumn(size_t column, const Array<T, R>& arr) noexcept {
     for (size_t i = 0; i < R; i++) {
-      m[i][column] = arr[i];
+      _data.Use[i][column] = arr[i];
     }
   }
 
@@ -180,6 +180,23 @@ constexpr Array<T, N> Multiply(const Matrix<T, N, N>& lhs, const Array<T, N>& rh
   }
   return result;
 }
+//SoA形式批量计算矩阵乘向量，rhs[k][j]是第j个向量的第k个分量，一次算L个向量
+//运算顺序和上面逐个向量的Multiply一样，所以结果完全相同，最内层的循环可以被编译器向量化
+template <class T, size_t N, size_t L>
+constexpr Array<Array<T, L>, N> MultiplySoA(const Matrix<T, N, N>& lhs, const Array<Array<T, L>, N>& rhs) noexcept {
+  Array<Array<T, L>, N> result;
+  for (size_t i = 0; i < N; i++) {
+    for (size_t j = 0; j < L; j++) {
+      result[i][j] = static_cast<T>(0.0);
+    }
+    for (size_t k = 0; k < N; k++) {
+      for (size_t j = 0; j < L; j++) {
+        result[i][j] += lhs(i, k) * rhs[k][j];
+      }
+    }
+  }
+  return result;
+}
 template <class T, size_t R, size_t C>
 constexpr bool operator==(const Matrix<T, R, C>& lhs, const Matrix<T, R, C>& rhs) noexcept {
   auto x = Matrix<T, R, C>::ContainerSize;
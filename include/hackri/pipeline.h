@@ -0,0 +1,759 @@
+#ifndef __HACKRI_PIPELINE_H__
+#define __HACKRI_PIPELINE_H__
+
+#include <hackri/renderer.h>
+#include <hackri/rasterizer.h>
+#include <hackri/simd.h>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+
+namespace hackri {
+//###############
+//# 固定管线状态 #
+//###############
+//Renderer::Draw的模板参数，编译期就确定的状态，函数都是constexpr，内联之后分支会被折叠掉
+//为了和运行时版本共用一套代码，所有函数都带着pso参数，编译期版本直接忽略它
+
+//深度测试
+template <TestComparison Func>
+struct DepthFunc {
+  static constexpr bool IsEnabled(const PipelineState&) noexcept { return true; }
+  static constexpr TestComparison Comparison(const PipelineState&) noexcept { return Func; }
+};
+using DepthLess = DepthFunc<TestComparison::Less>;
+using DepthLessEqual = DepthFunc<TestComparison::LessEqual>;
+//不做深度测试，也不写深度
+struct DepthDisable {
+  static constexpr bool IsEnabled(const PipelineState&) noexcept { return false; }
+  static constexpr TestComparison Comparison(const PipelineState&) noexcept { return TestComparison::Always; }
+};
+//运行时读PSO里的IsUseDepthTest和DepthTest
+struct DepthFromPSO {
+  static constexpr bool IsEnabled(const PipelineState& pso) noexcept { return pso.IsUseDepthTest; }
+  static constexpr TestComparison Comparison(const PipelineState& pso) noexcept { return pso.DepthTest; }
+};
+
+//颜色混合，混合常量依然来自pso.BlendColorConstant
+template <BlendColor SrcRGB, BlendColor DstRGB, BlendColor SrcA, BlendColor DstA, BlendEquation Op = BlendEquation::Add>
+struct BlendState {
+  static constexpr bool IsEnabled(const PipelineState&) noexcept { return true; }
+  static constexpr Color4f Apply(const PipelineState& pso, const Color4f& src, const Color4f& dst) noexcept {
+    return BlendImpl(src, dst, pso.BlendColorConstant, SrcRGB, DstRGB, SrcA, DstA, Op);
+  }
+  //pso里的混合设置是不是和它一样
+  static constexpr bool IsMatch(const PipelineState& pso) noexcept {
+    return pso.IsUseBlend &&
+           pso.BlendSrcFactorRGB == SrcRGB && pso.BlendDstFactorRGB == DstRGB &&
+           pso.BlendSrcFactorA == SrcA && pso.BlendDstFactorA == DstA &&
+           pso.BlendOp == Op;
+  }
+};
+using BlendAlpha = BlendState<BlendColor::SrcAlpha, BlendColor::OneMinusSrcAlpha, BlendColor::One, BlendColor::OneMinusSrcAlpha>;
+using BlendPremultiplied = BlendState<BlendColor::One, BlendColor::OneMinusSrcAlpha, BlendColor::One, BlendColor::OneMinusSrcAlpha>;
+using BlendAdditive = BlendState<BlendColor::One, BlendColor::One, BlendColor::One, BlendColor::One>;
+using BlendReplace = BlendState<BlendColor::One, BlendColor::Zero, BlendColor::One, BlendColor::Zero>;
+//不混合，直接覆盖
+struct BlendDisable {
+  static constexpr bool IsEnabled(const PipelineState&) noexcept { return false; }
+  static constexpr Color4f Apply(const PipelineState&, const Color4f& src, const Color4f&) noexcept { return src; }
+};
+//运行时读PSO里的混合设置
+struct BlendFromPSO {
+  static constexpr bool IsEnabled(const PipelineState& pso) noexcept { return pso.IsUseBlend; }
+  static constexpr Color4f Apply(const PipelineState& pso, const Color4f& src, const Color4f& dst) noexcept {
+    return BlendImpl(src, dst, pso.BlendColorConstant,
+                     pso.BlendSrcFactorRGB, pso.BlendDstFactorRGB, pso.BlendSrcFactorA, pso.BlendDstFactorA,
+                     pso.BlendOp);
+  }
+};
+
+//################
+//# 三角形光栅化 #
+//################
+//只写深度的pass（z-prepass、阴影）用的PS，光栅化时只做覆盖和深度测试，不插值也不着色
+//没有颜色目标（见PipelineInput::HasColorTarget）时不管传进来的是什么PS都会换成它
+struct NoPixelShader {};
+template <class PS>
+constexpr bool IsNoPixelShader = std::is_same_v<PS, NoPixelShader>;
+//可见性缓冲的第一遍用的PS，通过深度测试的像素只写入可见性ID（见PipelineInput::VisibilityBuffer）
+struct VisibilityShader {};
+template <class PS>
+constexpr bool IsVisibilityShader = std::is_same_v<PS, VisibilityShader>;
+//PS是批量版本（签名和BatchPixelShader一样）时为true
+template <class PS>
+constexpr bool IsBatchPixelShader = std::is_invocable_v<const PS&, const PixelBatchParams&, PixelBatchResult&>;
+//光栅化三角形需要的PS输入（float个数），逐像素的PS一次插值一个quad，批量PS一次插值相邻两列
+template <class PS>
+constexpr size_t GetPixelInputCount(size_t vsOutFloatCnt) noexcept {
+  return std::max(vsOutFloatCnt, size_t(1)) * (IsBatchPixelShader<PS> ? PIXEL_BATCH_SIZE * 2 : QUAD_PIXEL_COUNT);
+}
+//PS之后的alpha测试、混合和写入
+//目标最多只读一次，既没有alpha测试也没有混合时直接写，打包格式不用解码
+template <class Blend>
+void OutputMerge(const PipelineState& pso, ColorTarget& target, uint32_t x, uint32_t y, const Color4f& src) {
+  if (!pso.IsUseAlphaTest && !Blend::IsEnabled(pso)) {
+    target.Store(x, y, src);
+    return;
+  }
+  const Color4f dst = target.Load(x, y);
+  //alpha测试
+  if (pso.IsUseAlphaTest) {
+    if (!TestImpl(src.A(), dst.A(), pso.AlphaTest)) {
+      return;
+    }
+  }
+  if (Blend::IsEnabled(pso)) {
+    //混合
+    target.Store(x, y, Blend::Apply(pso, src, dst));
+  } else {
+    target.Store(x, y, src);
+  }
+}
+//一列像素的输出合并，mask里的lane j把colors[j]合并到(x, y0 + j)，y0必须是8的倍数
+using OutputMergeFunc = void (*)(
+    const PipelineState& pso, ColorTarget& target,
+    uint32_t x, uint32_t y0, uint32_t mask, const Color4f* colors);
+//8x8对齐的块里一列8个像素在两种布局下都是连续的，浮点目标只找一次地址，每个像素只读写一次
+//打包格式逐像素解码编码，和OutputMerge一样
+template <class Blend>
+void OutputMergeColumn(
+    const PipelineState& pso, ColorTarget& target,
+    uint32_t x, uint32_t y0, uint32_t mask, const Color4f* colors) {
+  if (target.Float == nullptr) {
+    for (uint32_t live = mask; live != 0; live &= live - 1) {
+      const int j = CountTrailingZero(live);
+      OutputMerge<Blend>(pso, target, x, y0 + j, colors[j]);
+    }
+    return;
+  }
+  Color4f* dst = &(*target.Float)(x, y0);
+  if (!pso.IsUseAlphaTest && !Blend::IsEnabled(pso)) {
+    for (uint32_t live = mask; live != 0; live &= live - 1) {
+      const int j = CountTrailingZero(live);
+      dst[j] = colors[j];
+    }
+    return;
+  }
+  for (uint32_t live = mask; live != 0; live &= live - 1) {
+    const int j = CountTrailingZero(live);
+    const Color4f& src = colors[j];
+    const Color4f old = dst[j];
+    if (pso.IsUseAlphaTest && !TestImpl(src.A(), old.A(), pso.AlphaTest)) {
+      continue;
+    }
+    dst[j] = Blend::IsEnabled(pso) ? Blend::Apply(pso, src, old) : src;
+  }
+}
+//每次draw选一次输出合并的实现，编译期的混合状态直接用对应的版本
+//BlendFromPSO时按PSO里的设置选：不混合、alpha、预乘alpha、叠加都有特化的版本，因子和方程的switch被折叠掉
+//和它们都不一样的才逐像素读设置
+template <class Blend>
+OutputMergeFunc GetOutputMergeFunc(const PipelineState& pso) noexcept {
+  if constexpr (!std::is_same_v<Blend, BlendFromPSO>) {
+    return OutputMergeColumn<Blend>;
+  } else {
+    if (!pso.IsUseBlend || BlendReplace::IsMatch(pso)) {
+      return OutputMergeColumn<BlendDisable>;
+    } else if (BlendAlpha::IsMatch(pso)) {
+      return OutputMergeColumn<BlendAlpha>;
+    } else if (BlendPremultiplied::IsMatch(pso)) {
+      return OutputMergeColumn<BlendPremultiplied>;
+    } else if (BlendAdditive::IsMatch(pso)) {
+      return OutputMergeColumn<BlendAdditive>;
+    }
+    return OutputMergeColumn<BlendFromPSO>;
+  }
+}
+//MSAA的输出合并，coverage是这个像素上被覆盖并通过深度测试的采样
+//覆盖所有采样时每个采样的结果都一样，压缩的像素只合并一次；只覆盖部分采样时先展开，再逐个采样合并
+template <class Blend>
+void OutputMergeMultisample(
+    const PipelineState& pso, MultisampleBuffer& target,
+    uint32_t x, uint32_t y, uint32_t coverage, const Color4f& src) {
+  const uint32_t allSamples = (1u << target.GetSampleCount()) - 1;
+  if (coverage == allSamples && !pso.IsUseAlphaTest && !Blend::IsEnabled(pso)) {
+    target.StoreUniform(x, y, src);
+    return;
+  }
+  if (target.IsUniform(x, y)) {
+    if (coverage == allSamples) {
+      ColorTarget sample(&target.GetColor(0));
+      OutputMerge<Blend>(pso, sample, x, y, src);
+      return;
+    }
+    target.Expand(x, y);
+  }
+  for (uint32_t live = coverage; live != 0; live &= live - 1) {
+    ColorTarget sample(&target.GetColor(CountTrailingZero(live)));
+    OutputMerge<Blend>(pso, sample, x, y, src);
+  }
+}
+//在屏幕上的(px, py)插值顶点属性，结果写进pixelInput，像素(x, y)的中心是(x + 0.5, y + 0.5)
+//透视矫正，插值出来的attr/w除以1/w
+inline void InterpolatePixel(
+    const VertexShaderOutLayout& layout, const TriangleSetup& tri, bool hasPerspective,
+    float px, float py, float* pixelInput) noexcept {
+  const float dx = px - tri.PlaneOrigin.X();
+  const float dy = py - tri.PlaneOrigin.Y();
+  const float normalize = hasPerspective ? 1.0f / EvaluatePlane(tri.InvWPlane, dx, dy) : 0.0f;
+  layout.ForEachSegment([&](size_t begin, size_t end, Interpolation mode) {
+    for (size_t i = begin; i < end; i++) {
+      switch (mode) {
+        case Interpolation::Perspective:
+        case Interpolation::Centroid:
+          pixelInput[i] = EvaluatePlane(tri.AttrPlane[i], dx, dy) * normalize;
+          break;
+        case Interpolation::NoPerspective:
+          pixelInput[i] = EvaluatePlane(tri.AttrPlane[i], dx, dy);
+          break;
+        case Interpolation::Flat:
+          pixelInput[i] = tri.AttrPlane[i].Z();
+          break;
+      }
+    }
+  });
+}
+//插值一列8个位置(px, py + j * step)，SoA排列，算法和逐像素的版本完全一样，结果也一样
+//每个平面先算出这一列的起点，之后每个像素只需要一次乘加
+inline void InterpolateColumn(
+    const VertexShaderOutLayout& layout, const TriangleSetup& tri, bool hasPerspective,
+    float px, float py, float step, float* pixelInput) noexcept {
+  const float dx = px - tri.PlaneOrigin.X();
+  float dy[PIXEL_BATCH_SIZE], normalize[PIXEL_BATCH_SIZE];
+  for (uint32_t j = 0; j < PIXEL_BATCH_SIZE; j++) {
+    dy[j] = py + (float)j * step - tri.PlaneOrigin.Y();
+  }
+  if (hasPerspective) {
+    const float invWColumn = tri.InvWPlane.Z() + tri.InvWPlane.X() * dx;
+    for (uint32_t j = 0; j < PIXEL_BATCH_SIZE; j++) {
+      normalize[j] = 1.0f / (invWColumn + tri.InvWPlane.Y() * dy[j]);
+    }
+  } else {
+    std::fill(normalize, normalize + PIXEL_BATCH_SIZE, 1.0f);  //没有透视插值的属性，不会用到
+  }
+  layout.ForEachSegment([&](size_t begin, size_t end, Interpolation mode) {
+    for (size_t k = begin; k < end; k++) {
+      const Vector3f& plane = tri.AttrPlane[k];
+      const float column = plane.Z() + plane.X() * dx;
+      float* lanes = pixelInput + k * PIXEL_BATCH_SIZE;
+      switch (mode) {
+        case Interpolation::Perspective:
+        case Interpolation::Centroid:
+          for (uint32_t j = 0; j < PIXEL_BATCH_SIZE; j++) {
+            lanes[j] = (column + plane.Y() * dy[j]) * normalize[j];
+          }
+          break;
+        case Interpolation::NoPerspective:
+          for (uint32_t j = 0; j < PIXEL_BATCH_SIZE; j++) {
+            lanes[j] = column + plane.Y() * dy[j];
+          }
+          break;
+        case Interpolation::Flat:
+          std::fill(lanes, lanes + PIXEL_BATCH_SIZE, plane.Z());
+          break;
+      }
+    }
+  });
+}
+//只重新插值Centroid的属性，在(px, py)处，第i个float写进pixelInput[i * stride]
+//MSAA下部分覆盖的像素先按像素中心插值，再用它把Centroid的属性挪到被覆盖的采样上
+inline void InterpolateCentroid(
+    const VertexShaderOutLayout& layout, const TriangleSetup& tri,
+    float px, float py, size_t stride, float* pixelInput) noexcept {
+  const float dx = px - tri.PlaneOrigin.X();
+  const float dy = py - tri.PlaneOrigin.Y();
+  const float normalize = 1.0f / EvaluatePlane(tri.InvWPlane, dx, dy);
+  layout.ForEachSegment([&](size_t begin, size_t end, Interpolation mode) {
+    if (mode != Interpolation::Centroid) {
+      return;
+    }
+    for (size_t i = begin; i < end; i++) {
+      pixelInput[i * stride] = EvaluatePlane(tri.AttrPlane[i], dx, dy) * normalize;
+    }
+  });
+}
+//8x8块里Centroid属性的插值位置，Mask置位的像素改在像素中心加上Offset[bit]的位置插值（单位是像素）
+struct BlockCentroid {
+  uint64_t Mask;
+  Vector2f Offset[BLOCK_SIZE * BLOCK_SIZE];
+};
+//8x8块里从(cx, cy)开始的rate x rate个像素在mask里对应的位
+inline uint64_t GetCellMask(uint64_t mask, uint32_t cx, uint32_t cy, uint32_t rate) noexcept {
+  const uint64_t column = ((uint64_t(1) << rate) - 1) << cy;
+  uint64_t cell = 0;
+  for (uint32_t i = 0; i < rate; i++) {
+    cell |= column << ((cx + i) * BLOCK_SIZE);
+  }
+  return mask & cell;
+}
+//从(x0, y0)开始的8x8块的着色率，pso和着色率图像取较粗的那个
+inline uint32_t GetShadingRate(const PipelineInput& input, const PipelineState& pso, uint32_t x0, uint32_t y0) noexcept {
+  uint32_t rate = (uint32_t)pso.PixelShadingRate;
+  if (input.ShadingRateImage != nullptr) {
+    rate = std::max(rate, (uint32_t)(*input.ShadingRateImage)(x0 / BLOCK_SIZE, y0 / BLOCK_SIZE));
+  }
+  assert(rate == 1 || rate == 2 || rate == 4);
+  return rate;
+}
+//对8x8块里mask置位的像素运行PS，结果交给merge(x, y, bit, color)写入，bit是像素在块里的下标
+//每个rate x rate的粗像素在它的中心插值，运行一次PS，结果写进里面所有被覆盖的像素，rate是1时就是逐像素着色
+//按2x2个粗像素组成的quad着色，quad里只要有一个粗像素被覆盖，四个都要插值，PS才能算导数
+//hasPerspective就是pso.OutLayout.HasPerspective()
+//centroid不为空时挪动部分覆盖像素的Centroid属性（只有MSAA会用），只在rate是1时生效，粗像素总是在中心插值
+template <class PS, class Merge>
+void ShadeBlock(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    const TriangleSetup& tri,
+    bool hasPerspective,
+    uint32_t x0, uint32_t y0, uint64_t mask, uint32_t rate,
+    const BlockCentroid* centroid,
+    Span<float> pixelInput,
+    const PS& ps,
+    Merge&& merge) {
+  const VertexShaderOutLayout& layout = pso.OutLayout;
+  const size_t floatCnt = std::max(layout.Size / sizeof(float), size_t(1));
+  const float halfRate = 0.5f * (float)rate;
+  const uint64_t centroidMask = centroid != nullptr && rate == 1 ? centroid->Mask : 0;
+  auto mergeCell = [&](uint64_t cell, const Color4f& color) -> void {
+    for (; cell != 0; cell &= cell - 1) {
+      const int bit = CountTrailingZero(cell);
+      merge(x0 + bit / BLOCK_SIZE, y0 + bit % BLOCK_SIZE, bit, color);
+    }
+  };
+  if constexpr (IsBatchPixelShader<PS>) {
+    //一列粗像素的有效lane
+    auto getColumnMask = [&](uint32_t cx) -> uint32_t {
+      if (rate == 1) {
+        return uint32_t(mask >> (cx * BLOCK_SIZE)) & 0xff;
+      }
+      uint32_t lanes = 0;
+      for (uint32_t j = 0; j < BLOCK_SIZE / rate; j++) {
+        lanes |= GetCellMask(mask, cx, j * rate, rate) != 0 ? 1u << j : 0u;
+      }
+      return lanes;
+    };
+    //相邻两列粗像素是一排quad，有一列被覆盖时两列都插值
+    float* columnInput[2] = {pixelInput.GetPointer(), pixelInput.GetPointer() + floatCnt * PIXEL_BATCH_SIZE};
+    for (uint32_t i = 0; i < BLOCK_SIZE; i += rate * 2) {
+      const uint32_t columns[2] = {getColumnMask(i), getColumnMask(i + rate)};
+      if ((columns[0] | columns[1]) == 0) {
+        continue;
+      }
+      for (uint32_t k = 0; k < 2; k++) {
+        InterpolateColumn(layout, tri, hasPerspective,
+                          (float)(x0 + i + k * rate) + halfRate, (float)y0 + halfRate, (float)rate,
+                          columnInput[k]);
+        const uint32_t cx = i + k * rate;
+        for (uint32_t live = uint32_t(centroidMask >> (cx * BLOCK_SIZE)) & 0xff; live != 0; live &= live - 1) {
+          const uint32_t j = CountTrailingZero(live);
+          const Vector2f& offset = centroid->Offset[cx * BLOCK_SIZE + j];
+          InterpolateCentroid(layout, tri, (float)(x0 + cx) + 0.5f + offset.X(), (float)(y0 + j) + 0.5f + offset.Y(),
+                              PIXEL_BATCH_SIZE, columnInput[k] + j);
+        }
+      }
+      for (uint32_t k = 0; k < 2; k++) {
+        if (columns[k] == 0) {  //helper列，只给另一列算导数
+          continue;
+        }
+        const uint32_t cx = i + k * rate;
+        PixelBatchParams psParam{columnInput[k], input.CBuffer, columns[k], x0 + cx, y0, columnInput[k ^ 1], rate};
+        PixelBatchResult result;
+        result.Discard = 0;
+        ps(psParam, result);
+        for (uint32_t live = columns[k] & ~result.Discard; live != 0; live &= live - 1) {
+          const uint32_t j = CountTrailingZero(live);
+          mergeCell(GetCellMask(mask, cx, j * rate, rate), result.GetColor(j));
+        }
+      }
+    }
+  } else {
+    const uint8_t* quadInput = pixelInput.Cast<uint8_t>().GetPointer();
+    const size_t quadStride = floatCnt * sizeof(float);
+    const uint32_t quadSize = rate * 2;
+    for (uint32_t qx = 0; qx < BLOCK_SIZE; qx += quadSize) {
+      for (uint32_t qy = 0; qy < BLOCK_SIZE; qy += quadSize) {
+        //quad里的编号是(x & 1) * 2 + (y & 1)，x、y是粗像素的坐标
+        uint64_t cells[QUAD_PIXEL_COUNT];
+        uint64_t quad = 0;
+        for (uint32_t lane = 0; lane < QUAD_PIXEL_COUNT; lane++) {
+          cells[lane] = GetCellMask(mask, qx + lane / 2 * rate, qy + lane % 2 * rate, rate);
+          quad |= cells[lane];
+        }
+        if (quad == 0) {
+          continue;
+        }
+        for (uint32_t lane = 0; lane < QUAD_PIXEL_COUNT; lane++) {
+          InterpolatePixel(layout, tri, hasPerspective,
+                           (float)(x0 + qx + lane / 2 * rate) + halfRate, (float)(y0 + qy + lane % 2 * rate) + halfRate,
+                           pixelInput.GetPointer() + lane * floatCnt);
+          const uint32_t bit = (qx + lane / 2) * BLOCK_SIZE + qy + lane % 2;
+          if ((centroidMask >> bit & 1) != 0) {
+            const Vector2f& offset = centroid->Offset[bit];
+            InterpolateCentroid(layout, tri,
+                                (float)(x0 + qx + lane / 2) + 0.5f + offset.X(), (float)(y0 + qy + lane % 2) + 0.5f + offset.Y(),
+                                1, pixelInput.GetPointer() + lane * floatCnt);
+          }
+        }
+        for (uint32_t lane = 0; lane < QUAD_PIXEL_COUNT; lane++) {
+          if (cells[lane] == 0) {
+            continue;
+          }
+          //使用插值后的结果计算像素颜色
+          PixelShaderParams psParam{quadInput + lane * quadStride, input.CBuffer, quadInput, quadStride, lane};
+          bool isDiscard = false;
+          Color4f src = ps(psParam, isDiscard);
+          if (isDiscard) {  //丢弃PS结果
+            continue;
+          }
+          mergeCell(cells[lane], src);
+        }
+      }
+    }
+  }
+}
+//在rect（闭区间，必须在三角形包围盒内）范围内光栅化三角形
+//以8x8块为单位，先由SIMD实现算出覆盖和深度测试的结果，再逐个像素着色
+//有Hi-Z时先用64x64块和8x8块的深度范围整块剔除，写入深度后更新对应的8x8块
+//不会分配内存，pixelInput由调用者提供（大小见GetPixelInputCount），所以多线程下每个线程各用一份就行
+//T是深度缓冲的元素类型，由blockCoverage决定，mergeColumn是每次draw选好的输出合并（见GetOutputMergeFunc）
+template <class Depth, class T, class PS>
+void RasterizeTriangle(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    const TriangleSetup& tri,
+    const Array<uint32_t, 4>& rect,
+    Span<float> pixelInput,
+    BlockCoverageFunc<T> blockCoverage,
+    OutputMergeFunc mergeColumn,
+    const PS& ps) {
+  const bool hasPerspective = pso.OutLayout.HasPerspective();
+  const TestComparison depthTest = Depth::Comparison(pso);
+  Buffer2d<T>* depthBuffer = Depth::IsEnabled(pso) ? input.GetDepthTarget<T>() : nullptr;
+  HiZBuffer* hiz = depthBuffer != nullptr ? input.HiZ : nullptr;
+  ColorTarget colorTarget(input);  //只写深度时不会用到
+  BlockCoverage block;
+  for (uint32_t cx0 = rect[0] & ~(TILE_SIZE - 1); cx0 <= rect[2]; cx0 += TILE_SIZE) {
+    for (uint32_t cy0 = rect[1] & ~(TILE_SIZE - 1); cy0 <= rect[3]; cy0 += TILE_SIZE) {
+      Array<uint32_t, 4> tileRect(
+          std::max(rect[0], cx0), std::max(rect[1], cy0),
+          std::min(rect[2], cx0 + TILE_SIZE - 1), std::min(rect[3], cy0 + TILE_SIZE - 1));
+      //整个64x64块都不可能通过深度测试
+      if (hiz != nullptr &&
+          IsHiZReject(tri.DepthBound(tileRect[0], tileRect[1], tileRect[2], tileRect[3]),
+                      hiz->GetCoarse(cx0 / TILE_SIZE, cy0 / TILE_SIZE), depthTest)) {
+        continue;
+      }
+      for (uint32_t x0 = tileRect[0] & ~(BLOCK_SIZE - 1); x0 <= tileRect[2]; x0 += BLOCK_SIZE) {
+        for (uint32_t y0 = tileRect[1] & ~(BLOCK_SIZE - 1); y0 <= tileRect[3]; y0 += BLOCK_SIZE) {
+          if (hiz != nullptr &&
+              IsHiZReject(tri.DepthBound(std::max(x0, tileRect[0]), std::max(y0, tileRect[1]),
+                                         std::min(x0 + BLOCK_SIZE - 1, tileRect[2]), std::min(y0 + BLOCK_SIZE - 1, tileRect[3])),
+                          hiz->GetBlock(x0 / BLOCK_SIZE, y0 / BLOCK_SIZE), depthTest)) {
+            continue;
+          }
+          //覆盖测试、深度测试、写入深度
+          blockCoverage(tri, x0, y0, tileRect, depthBuffer, block);
+          if (hiz != nullptr && block.Mask != 0) {
+            //只能更新当前tile对应的64x64块，见HiZBuffer
+            assert(x0 / HiZBuffer::COARSE_SIZE == cx0 / TILE_SIZE && y0 / HiZBuffer::COARSE_SIZE == cy0 / TILE_SIZE);
+            hiz->UpdateBlock(*depthBuffer, x0 / BLOCK_SIZE, y0 / BLOCK_SIZE);
+          }
+          if constexpr (IsNoPixelShader<PS>) {
+            continue;
+          } else if constexpr (IsVisibilityShader<PS>) {
+            const uint64_t id = MakeVisibilityID(input.DrawID, tri.PrimitiveID);
+            for (uint64_t mask = block.Mask; mask != 0; mask &= mask - 1) {
+              const int bit = CountTrailingZero(mask);
+              (*input.VisibilityBuffer)(x0 + bit / BLOCK_SIZE, y0 + bit % BLOCK_SIZE) = id;
+            }
+          } else {
+            //PS的结果先存下来，再按列交给输出合并
+            Color4f colors[BLOCK_SIZE * BLOCK_SIZE];
+            uint64_t shaded = 0;
+            ShadeBlock(input, pso, tri, hasPerspective, x0, y0, block.Mask, GetShadingRate(input, pso, x0, y0), nullptr, pixelInput, ps,
+                       [&](uint32_t, uint32_t, int bit, const Color4f& color) {
+                         colors[bit] = color;
+                         shaded |= uint64_t(1) << bit;
+                       });
+            for (uint32_t i = 0; i < BLOCK_SIZE; i++) {
+              const uint32_t column = uint32_t(shaded >> (i * BLOCK_SIZE)) & 0xff;
+              if (column != 0) {
+                mergeColumn(pso, colorTarget, x0 + i, y0, column, colors + i * BLOCK_SIZE);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+//MSAA版本的RasterizeTriangle，目标是input.Multisample，不使用Hi-Z
+//每个采样用平移到采样点的三角形（见OffsetToSample）调用一次blockCoverage，覆盖和深度都是逐采样的
+//至少有一个采样被覆盖的像素在像素中心运行一次PS，结果写进被覆盖的采样
+//部分覆盖的像素里Centroid属性改在第一个被覆盖的采样上插值，不会外推到三角形外面
+template <class Depth, class Blend, class PS>
+void RasterizeTriangleMultisample(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    const TriangleSetup& tri,
+    const Array<uint32_t, 4>& rect,
+    Span<float> pixelInput,
+    BlockCoverageFunc<float> blockCoverage,
+    const PS& ps) {
+  MultisampleBuffer& target = *input.Multisample;
+  const uint32_t sampleCount = target.GetSampleCount();
+  const bool hasPerspective = pso.OutLayout.HasPerspective();
+  const bool hasCentroid = pso.OutLayout.HasCentroid();
+  const uint8_t fullCoverage = uint8_t((1u << sampleCount) - 1);
+  TriangleSetup sampleTri[MultisampleBuffer::MAX_SAMPLE_COUNT];
+  for (uint32_t s = 0; s < sampleCount; s++) {
+    sampleTri[s] = OffsetToSample(tri, GetSamplePosition(sampleCount, s));
+  }
+  BlockCoverage block;
+  BlockCentroid centroid;
+  for (uint32_t x0 = rect[0] & ~(BLOCK_SIZE - 1); x0 <= rect[2]; x0 += BLOCK_SIZE) {
+    for (uint32_t y0 = rect[1] & ~(BLOCK_SIZE - 1); y0 <= rect[3]; y0 += BLOCK_SIZE) {
+      uint64_t mask = 0;
+      uint8_t coverage[BLOCK_SIZE * BLOCK_SIZE] = {};  //每个像素被覆盖的采样
+      for (uint32_t s = 0; s < sampleCount; s++) {
+        blockCoverage(sampleTri[s], x0, y0, rect, Depth::IsEnabled(pso) ? &target.GetDepth(s) : nullptr, block);
+        mask |= block.Mask;
+        for (uint64_t live = block.Mask; live != 0; live &= live - 1) {
+          coverage[CountTrailingZero(live)] |= uint8_t(1u << s);
+        }
+      }
+      if constexpr (!IsNoPixelShader<PS> && !IsVisibilityShader<PS>) {
+        centroid.Mask = 0;
+        for (uint64_t live = hasCentroid ? mask : 0; live != 0; live &= live - 1) {
+          const int bit = CountTrailingZero(live);
+          if (coverage[bit] != fullCoverage) {
+            const int32_t* offset = GetSamplePosition(sampleCount, CountTrailingZero(coverage[bit]));
+            centroid.Offset[bit] = Vector2f((float)offset[0] / (float)SUBPIXEL_SCALE, (float)offset[1] / (float)SUBPIXEL_SCALE);
+            centroid.Mask |= uint64_t(1) << bit;
+          }
+        }
+        ShadeBlock(input, pso, tri, hasPerspective, x0, y0, mask, GetShadingRate(input, pso, x0, y0), &centroid, pixelInput, ps,
+                   [&](uint32_t x, uint32_t y, int bit, const Color4f& color) {
+                     OutputMergeMultisample<Blend>(pso, target, x, y, coverage[bit], color);
+                   });
+      }
+    }
+  }
+}
+//光栅化三角形设置的结果，按提交顺序
+//memory.Workers不为空时用sort-middle分块，让所有线程按tile并行光栅化
+//每个tile内部按提交顺序处理三角形，每个像素上的操作顺序和单线程完全一样，所以结果逐位相同
+//T是深度缓冲的元素类型，见RasterizeTriangles
+template <class Depth, class Blend, class T, class PS>
+void RasterizeTrianglesImpl(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    PipelineMemory& memory,
+    const std::pmr::vector<TriangleSetup>& triangles,
+    const PS& ps) {
+  const BlockCoverageFunc<T> blockCoverage = GetBlockCoverageFunc<T>(Depth::Comparison(pso));
+  const OutputMergeFunc mergeColumn = GetOutputMergeFunc<Blend>(pso);
+  const size_t vsOutFloatCnt = pso.OutLayout.Size / sizeof(float);
+  const size_t pixelInputCount = GetPixelInputCount<PS>(vsOutFloatCnt);
+  auto rasterize = [&](const TriangleSetup& tri, const Array<uint32_t, 4>& rect, Span<float> pixelInput) -> void {
+    if constexpr (std::is_same_v<T, float>) {
+      if (input.Multisample != nullptr) {
+        RasterizeTriangleMultisample<Depth, Blend>(input, pso, tri, rect, pixelInput, blockCoverage, ps);
+        return;
+      }
+    }
+    RasterizeTriangle<Depth>(input, pso, tri, rect, pixelInput, blockCoverage, mergeColumn, ps);
+  };
+  if (memory.Workers == nullptr) {
+    Span<float> pixelInput = memory.AllocToSpan<float>(pixelInputCount);
+    for (const TriangleSetup& tri : triangles) {
+      rasterize(tri, tri.BBox, pixelInput);
+    }
+    return;
+  }
+  //深度只会单调变化的比较方式下，分tile时就能用绘制前的Hi-Z剔除整个tile
+  const TestComparison depthTest = Depth::Comparison(pso);
+  const bool isUseHiZ = Depth::IsEnabled(pso) && input.Multisample == nullptr &&
+                        input.GetDepthTarget<T>() != nullptr && IsHiZMonotonic(depthTest);
+  TileBins bins = BinTriangles(input, memory, triangles, isUseHiZ ? input.HiZ : nullptr, depthTest);
+  //每个线程一份PS输入
+  const size_t workerCount = memory.Workers->GetWorkerCount();
+  Span<float> psIn = memory.AllocToSpan<float>(pixelInputCount * workerCount);
+  memory.Workers->ParallelFor(bins.GetTileCount(), [&](size_t tile, size_t worker) {
+    Array<uint32_t, 4> tileRect = bins.GetTileRect(tile, input.FrameWidth, input.FrameHeight);
+    Span<float> pixelInput = psIn.Slice(worker * pixelInputCount, pixelInputCount);
+    for (uint32_t i = bins.Start[tile]; i < bins.Start[tile + 1]; i++) {
+      const TriangleSetup& tri = triangles[bins.Triangles[i]];
+      Array<uint32_t, 4> rect(
+          std::max(tri.BBox[0], tileRect[0]), std::max(tri.BBox[1], tileRect[1]),
+          std::min(tri.BBox[2], tileRect[2]), std::min(tri.BBox[3], tileRect[3]));
+      //rect不能跨tile，否则会访问别的线程负责的Hi-Z 64x64块
+      assert(rect[0] / TILE_SIZE == rect[2] / TILE_SIZE && rect[1] / TILE_SIZE == rect[3] / TILE_SIZE);
+      rasterize(tri, rect, pixelInput);
+    }
+  });
+}
+//按设置了哪个深度缓冲选择实现，优先级是Multisample、Depth16Buffer、Depth24Buffer、DepthBuffer
+template <class Depth, class Blend, class PS>
+void RasterizeTriangles(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    PipelineMemory& memory,
+    const std::pmr::vector<TriangleSetup>& triangles,
+    const PS& ps) {
+  if (triangles.empty()) {
+    return;
+  }
+  if constexpr (!IsNoPixelShader<PS> && !IsVisibilityShader<PS>) {
+    if (input.VisibilityBuffer != nullptr) {
+      RasterizeTriangles<Depth, BlendDisable>(input, pso, memory, triangles, VisibilityShader{});
+      return;
+    }
+    if (!input.HasColorTarget()) {
+      RasterizeTriangles<Depth, BlendDisable>(input, pso, memory, triangles, NoPixelShader{});
+      return;
+    }
+  }
+  if (input.Multisample != nullptr) {
+    assert(input.VisibilityBuffer == nullptr);  //MSAA不支持可见性缓冲
+    RasterizeTrianglesImpl<Depth, Blend, float>(input, pso, memory, triangles, ps);
+  } else if (input.Depth16Buffer != nullptr) {
+    RasterizeTrianglesImpl<Depth, Blend, uint16_t>(input, pso, memory, triangles, ps);
+  } else if (input.Depth24Buffer != nullptr) {
+    RasterizeTrianglesImpl<Depth, Blend, uint32_t>(input, pso, memory, triangles, ps);
+  } else {
+    RasterizeTrianglesImpl<Depth, Blend, float>(input, pso, memory, triangles, ps);
+  }
+}
+//#############
+//# 顶点处理 #
+//#############
+//VS是批量版本（签名和BatchVertexShader一样）时为true
+template <class VS>
+constexpr bool IsBatchVertexShader = std::is_invocable_v<const VS&, const VertexBatchParams&>;
+//按8个顶点一批运行VS，结果转置回post-transform cache
+//isReferenced标记了需要变换的顶点，完全没有被引用的批会被跳过
+//memory.Workers不为空时多线程运行，每个线程处理连续的若干批
+template <class VS>
+void TransformVertexBatches(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    PipelineMemory& memory,
+    size_t vertexCount,
+    const Span<bool>& isReferenced,
+    Span<Vector4f>& cachePos,
+    Span<uint8_t>& cacheOut,
+    const VS& vs) {
+  constexpr size_t batchPerTask = 64;
+  const size_t vsOutSize = pso.OutLayout.Size;
+  const size_t vsOutFloatCnt = vsOutSize / sizeof(float);
+  const size_t batchCount = (vertexCount + VERTEX_BATCH_SIZE - 1) / VERTEX_BATCH_SIZE;
+  const size_t taskCount = (batchCount + batchPerTask - 1) / batchPerTask;
+  const size_t workerCount = memory.Workers == nullptr ? 1 : memory.Workers->GetWorkerCount();
+  const size_t scratchCount = std::max(vsOutFloatCnt, size_t(1)) * VERTEX_BATCH_SIZE;
+  Span<float> scratch = memory.AllocToSpan<float>(scratchCount * workerCount, 32);
+  auto task = [&](size_t index, size_t worker) -> void {
+    float* out = scratch.GetPointer() + worker * scratchCount;
+    const size_t last = std::min((index + 1) * batchPerTask, batchCount);
+    for (size_t batch = index * batchPerTask; batch < last; batch++) {
+      const size_t start = batch * VERTEX_BATCH_SIZE;
+      const size_t count = std::min(VERTEX_BATCH_SIZE, vertexCount - start);
+      if (std::none_of(isReferenced.GetPointer() + start, isReferenced.GetPointer() + start + count, [](bool b) { return b; })) {
+        continue;
+      }
+      Array<VertexLanes, 4> clipPos;
+      VertexBatchParams vsParam{input.Vertex, input.CBuffer, start, count, &clipPos, out};
+      vs(vsParam);
+      for (size_t j = 0; j < count; j++) {
+        cachePos[start + j] = Vector4f(clipPos[0][j], clipPos[1][j], clipPos[2][j], clipPos[3][j]);
+        float* vertexOut = reinterpret_cast<float*>(cacheOut.GetPointer() + (start + j) * vsOutSize);
+        for (size_t k = 0; k < vsOutFloatCnt; k++) {
+          vertexOut[k] = out[k * VERTEX_BATCH_SIZE + j];
+        }
+      }
+    }
+  };
+  if (memory.Workers == nullptr) {
+    for (size_t i = 0; i < taskCount; i++) {
+      task(i, 0);
+    }
+  } else {
+    memory.Workers->ParallelFor(taskCount, task);
+  }
+}
+//DrawIndexed和Draw共用的实现，vs、ps可以是任何可调用对象
+template <class Depth, class Blend, class VS, class PS>
+void DrawIndexedImpl(
+    const PipelineInput& input,
+    const size_t* indices, size_t indexCount,
+    const PipelineState& pso,
+    PipelineMemory& memory,
+    const VS& vs, const PS& ps) {
+  const size_t vsOutSize = pso.OutLayout.Size;
+  assert((vsOutSize % sizeof(float)) == 0);
+  assert((indexCount % 3) == 0);
+  if (indexCount == 0) {
+    return;
+  }
+  //post-transform cache，按顶点编号直接寻址，保证每个被引用的顶点只运行一次VS
+  size_t vertexCount = *std::max_element(indices, indices + indexCount) + 1;
+  Span<Vector4f> cachePos = memory.AllocToSpan<Vector4f>(vertexCount);
+  Span<uint8_t> cacheOut = memory.AllocToSpan<uint8_t>(vertexCount * vsOutSize);
+  Span<bool> isTransformed = memory.AllocToSpan<bool>(vertexCount);
+  SetupScratch scratch = AllocateSetupScratch(pso, memory);
+  isTransformed.Fill(false);
+  if constexpr (IsBatchVertexShader<VS>) {
+    //先标记被引用的顶点，再按批运行VS，之后的fetch都会命中缓存
+    for (size_t i = 0; i < indexCount; i++) {
+      isTransformed[indices[i]] = true;
+    }
+    TransformVertexBatches(input, pso, memory, vertexCount, isTransformed, cachePos, cacheOut, vs);
+  }
+  auto fetch = [&](size_t index) -> Span<uint8_t> {
+    Span<uint8_t> out = cacheOut.Slice(index * vsOutSize, vsOutSize);
+    if constexpr (!IsBatchVertexShader<VS>) {
+      if (!isTransformed[index]) {
+        //Vertex直接指向这个顶点，所以VS看到的三角形编号恒为0
+        VertexShaderParams vsParam{input.Vertex + index * pso.VertexSize,
+                                   {out.GetPointer(), nullptr, nullptr},
+                                   input.CBuffer};
+        cachePos[index] = vs(0, vsParam);
+        isTransformed[index] = true;
+      }
+    }
+    return out;
+  };
+  std::pmr::vector<TriangleSetup> triangles(memory.Arena);
+  if (!pso.IsDrawFrame) {
+    triangles.reserve(indexCount / 3);
+  }
+  //图元装配
+  for (size_t i = 0; i < indexCount; i += 3) {
+    const size_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+    Span<uint8_t> outA = fetch(a);
+    Span<uint8_t> outB = fetch(b);
+    Span<uint8_t> outC = fetch(c);
+    SetupClipSpaceTriangle(
+        input, pso, memory, uint32_t(i / 3),
+        cachePos[a], cachePos[b], cachePos[c],
+        outA, outB, outC,
+        scratch, triangles);
+  }
+  RasterizeTriangles<Depth, Blend>(input, pso, memory, triangles, ps);
+}
+
+template <class Depth, class Blend, class VS, class PS>
+void Renderer::Draw(
+    const PipelineInput& input,
+    const size_t* indices, size_t indexCount,
+    const PipelineState& pso,
+    PipelineMemory& memory,
+    const VS& vs, const PS& ps) {
+  assert(!pso.IsDrawFrame);  //线框模式只有运行时版本
+  DrawIndexedImpl<Depth, Blend>(input, indices, indexCount, pso, memory, vs, ps);
+}
+}  // namespace hackri
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef __HACKRI_RASTERIZER_H__
+#define __HACKRI_RASTERIZER_H__
+
+#include <hackri/mathematics.h>
+#include <hackri/buffer.h>
+#include <hackri/renderer.h>
+#include <algorithm>
+#include <memory_resource>
+#include <vector>
+
+namespace hackri {
+//光栅化内部使用的数据结构，Renderer之外一般用不到
+
+//#################
+//# 定点数半平面光栅化 #
+//#################
+constexpr int SUBPIXEL_BITS = 4;  //屏幕坐标保留4位小数，即1/16像素精度
+constexpr int64_t SUBPIXEL_SCALE = int64_t(1) << SUBPIXEL_BITS;
+//边函数E(x,y) = A*x + B*y + C，x、y都是定点数坐标
+//三角形内部E > 0，E == 0时由top-left规则决定归属，规则已经折算进C里（Bias），所以只要判断E >= 0
+struct EdgeFunction {
+  int64_t A, B, C;
+  int64_t Bias;  //0或-1，计算重心坐标时要减回去
+
+  constexpr int64_t Evaluate(int64_t x, int64_t y) const noexcept { return A * x + B * y + C; }
+  constexpr int64_t StepX() const noexcept { return A * SUBPIXEL_SCALE; }  //向x+走一个像素
+  constexpr int64_t StepY() const noexcept { return B * SUBPIXEL_SCALE; }  //向y+走一个像素
+};
+//屏幕空间的平面方程 v = plane.Z + plane.X * dx + plane.Y * dy，dx、dy是相对PlaneOrigin的偏移
+//各种实现都必须按这个顺序计算，保证结果一致
+constexpr float EvaluatePlane(const Vector3f& plane, float dx, float dy) noexcept {
+  float column = plane.Z() + plane.X() * dx;
+  return column + plane.Y() * dy;
+}
+//视口变换之后的三角形，光栅化只需要这些信息
+struct TriangleSetup {
+  Vector2f ScrPos[3];         //屏幕空间坐标
+  float DepthZ[3];            //[0,1]深度
+  Array<uint32_t, 4> BBox;    //屏幕空间包围盒，闭区间
+  EdgeFunction Edge[3];       //Edge[i]是顶点i对面那条边，E[i] / 面积就是顶点i的重心坐标
+  //深度平面 z = DepthPlane.Z + DepthPlane.X * (x - PlaneOrigin.X) + DepthPlane.Y * (y - PlaneOrigin.Y)
+  //PlaneOrigin是吸附后的0号顶点，以它为原点可以减少大坐标带来的精度损失
+  Vector3f DepthPlane;
+  Vector2f PlaneOrigin;
+  //透视矫正插值：屏幕空间里线性变化的是1/w和attr/w，每个像素算出两者相除就是attr
+  Vector3f InvWPlane;         //1/w的平面
+  //每个VS输出float的平面，透视矫正的是attr/w，屏幕空间线性的是attr，flat的只有常数项
+  //在arena里，draw call结束前一直有效
+  const Vector3f* AttrPlane;
+  float DepthMin, DepthMax;  //三个顶点深度的范围
+  float DepthError;          //DepthAt的浮点误差上界
+  uint32_t PrimitiveID;      //draw里的三角形编号，裁剪出来的三角形和原三角形一样，写进可见性缓冲
+
+  //像素中心在[x0,x1]x[y0,y1]内时插值深度的保守范围，给Hi-Z剔除用
+  Array<float, 2> DepthBound(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) const noexcept {
+    float dx0 = (float)x0 + 0.5f - PlaneOrigin.X(), dx1 = (float)x1 + 0.5f - PlaneOrigin.X();
+    float dy0 = (float)y0 + 0.5f - PlaneOrigin.Y(), dy1 = (float)y1 + 0.5f - PlaneOrigin.Y();
+    float ax0 = DepthPlane.X() * dx0, ax1 = DepthPlane.X() * dx1;
+    float by0 = DepthPlane.Y() * dy0, by1 = DepthPlane.Y() * dy1;
+    float lo = DepthPlane.Z() + std::min(ax0, ax1) + std::min(by0, by1);
+    float hi = DepthPlane.Z() + std::max(ax0, ax1) + std::max(by0, by1);
+    //平面上的范围和顶点范围取交集，两边各留一份误差
+    return Array<float, 2>(
+        std::max(DepthMin, lo - DepthError) - DepthError,
+        std::min(DepthMax, hi + DepthError) + DepthError);
+  }
+
+  //像素中心(x+0.5, y+0.5)处的插值深度，各种实现都必须按这个顺序计算，保证结果一致
+  float DepthAt(uint32_t x, uint32_t y) const noexcept {
+    return EvaluatePlane(DepthPlane, (float)x + 0.5f - PlaneOrigin.X(), (float)y + 0.5f - PlaneOrigin.Y());
+  }
+};
+//MSAA的采样位置，单位是1/16像素（和定点数坐标一样），相对像素中心
+//和D3D的标准采样模式一样，只是y轴向上所以y取反
+constexpr int32_t SAMPLE_POSITION_4X[4][2] = {{-2, 6}, {6, 2}, {-6, -2}, {2, -6}};
+constexpr int32_t SAMPLE_POSITION_8X[8][2] = {{1, 3}, {-1, -3}, {5, -1}, {-3, 5}, {-5, -5}, {-7, 1}, {3, -7}, {7, 7}};
+static_assert(SUBPIXEL_SCALE == 16, "sample positions are in 1/16 pixel");
+constexpr const int32_t* GetSamplePosition(uint32_t sampleCount, uint32_t sample) noexcept {
+  return sampleCount == 4 ? SAMPLE_POSITION_4X[sample] : SAMPLE_POSITION_8X[sample];
+}
+//把三角形的边函数和深度平面平移到采样点上，像素中心处的覆盖和深度就是采样点处的
+//这样覆盖和深度测试的实现不用改就能逐个采样使用
+inline TriangleSetup OffsetToSample(const TriangleSetup& tri, const int32_t* offset) noexcept {
+  TriangleSetup result = tri;
+  for (int i = 0; i < 3; i++) {
+    result.Edge[i].C += result.Edge[i].A * offset[0] + result.Edge[i].B * offset[1];
+  }
+  result.PlaneOrigin = Vector2f(tri.PlaneOrigin.X() - (float)offset[0] / (float)SUBPIXEL_SCALE,
+                                tri.PlaneOrigin.Y() - (float)offset[1] / (float)SUBPIXEL_SCALE);
+  return result;
+}
+constexpr uint32_t TILE_SIZE = 64;  //分块光栅化时tile的边长（像素）
+constexpr uint32_t BLOCK_SIZE = 8;  //光栅化的基本单位是8x8像素的块，块总是和屏幕上8的整数倍对齐
+
+constexpr bool TestImpl(float depth, float target, TestComparison func) noexcept {
+  switch (func) {
+    case hackri::TestComparison::Never:
+      return false;
+    case hackri::TestComparison::Less:
+      return depth < target;
+    case hackri::TestComparison::Equal:
+      return std::abs(depth - target) <= float(1e-5);
+    case hackri::TestComparison::LessEqual:
+      return depth <= target;
+    case hackri::TestComparison::Greater:
+      return depth > target;
+    case hackri::TestComparison::NotEqual:
+      return std::abs(depth - target) > float(1e-5);
+    case hackri::TestComparison::GreaterEqual:
+      return depth >= target;
+    case hackri::TestComparison::Always:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static_assert(BLOCK_SIZE == HiZBuffer::BLOCK_SIZE && TILE_SIZE == HiZBuffer::COARSE_SIZE, "Hi-Z must match raster blocks");
+
+//三角形在某个区域内的深度范围是bound，区域内已有深度范围是range，所有像素都不可能通过深度测试时返回true
+constexpr bool IsHiZReject(const Array<float, 2>& bound, const HiZBuffer::Range& range, TestComparison func) noexcept {
+  constexpr float equalEpsilon = float(2e-5);  //TestImpl里Equal的容差再放宽一点
+  switch (func) {
+    case hackri::TestComparison::Never:
+      return true;
+    case hackri::TestComparison::Less:
+      return bound[0] >= range[1];
+    case hackri::TestComparison::Equal:
+      return bound[0] > range[1] + equalEpsilon || bound[1] < range[0] - equalEpsilon;
+    case hackri::TestComparison::LessEqual:
+      return bound[0] > range[1];
+    case hackri::TestComparison::Greater:
+      return bound[1] <= range[0];
+    case hackri::TestComparison::GreaterEqual:
+      return bound[1] < range[0];
+    default:
+      return false;
+  }
+}
+//这些比较方式下深度只会单调变化（Less系列只会变小，Greater系列只会变大）
+//所以用绘制开始前的Hi-Z剔除也是保守的，可以在分tile的时候就用
+constexpr bool IsHiZMonotonic(TestComparison func) noexcept {
+  return func == TestComparison::Never ||
+         func == TestComparison::Less || func == TestComparison::LessEqual ||
+         func == TestComparison::Greater || func == TestComparison::GreaterEqual;
+}
+
+//一个8x8块的覆盖和深度测试结果，块内像素按列排列：下标i * 8 + j对应像素(x0 + i, y0 + j)
+struct BlockCoverage {
+  uint64_t Mask;                           //覆盖且通过深度测试的像素
+  float Depth[BLOCK_SIZE * BLOCK_SIZE];  //插值深度，只有Mask里的像素有意义
+};
+//计算三角形在(x0,y0)处8x8块内的覆盖，rect（闭区间）以外的像素不算
+//depthBuffer不为空时同时做深度测试，并写入通过测试的深度
+//T是深度缓冲的元素类型（见DepthFormat），D16/D24在存储值上比较，result.Depth依然是未量化的深度
+template <class T>
+using BlockCoverageFunc = void (*)(
+    const TriangleSetup& tri,
+    uint32_t x0, uint32_t y0,
+    const Array<uint32_t, 4>& rect,
+    Buffer2d<T>* depthBuffer,
+    BlockCoverage& result);
+//根据GetSimdLevel()选择AVX2、SSE2或者标量实现，深度比较方式在编译期特化，每次draw只选一次
+//T只能是float、uint16_t、uint32_t
+template <class T>
+BlockCoverageFunc<T> GetBlockCoverageFunc(TestComparison test) noexcept;
+
+//############
+//# 颜色混合 #
+//############
+constexpr Color4f GetBlendFactor(const Color4f& src, const Color4f& dst, const Color4f& c, BlendColor type) noexcept {
+  switch (type) {
+    case hackri::BlendColor::Zero:
+      return Color4f(0.0f);
+    case hackri::BlendColor::One:
+      return Color4f(1.0f);
+    case hackri::BlendColor::SrcColor:
+      return src;
+    case hackri::BlendColor::OneMinusSrcColor:
+      return Color4f(1.0f) - src;
+    case hackri::BlendColor::DstColor:
+      return dst;
+    case hackri::BlendColor::OneMinusDstColor:
+      return Color4f(1.0f) - dst;
+    case hackri::BlendColor::SrcAlpha:
+      return Color4f(src.A());
+    case hackri::BlendColor::OneMinusSrcAlpha:
+      return Color4f(1.0f) - Color4f(src.A());
+    case hackri::BlendColor::DstAlpha:
+      return Color4f(dst.A());
+    case hackri::BlendColor::OneMinusDstAlpha:
+      return Color4f(1.0f) - Color4f(dst.A());
+    case hackri::BlendColor::ConstantColor:
+      return c;
+    case hackri::BlendColor::OneMinusConstantColor:
+      return Color4f(1.0f) - c;
+    case hackri::BlendColor::ConstantAlpha:
+      return Color4f(c.A());
+    case hackri::BlendColor::OneMinusConstantAlpha:
+      return Color4f(1.0f) - Color4f(c.A());
+    default:
+      return Color4f(0.0f);
+  }
+}
+//混合因子和方程都是参数，编译期常量传进来时switch会被完全折叠
+constexpr Color4f BlendImpl(
+    const Color4f& src, const Color4f& dst, const Color4f& constant,
+    BlendColor srcRgb, BlendColor dstRgb, BlendColor srcA, BlendColor dstA,
+    BlendEquation op) noexcept {
+  Color3f srcRgbFactor = GetBlendFactor(src, dst, constant, srcRgb).XYZ();
+  Color3f dstRgbFactor = GetBlendFactor(src, dst, constant, dstRgb).XYZ();
+  float srcAFactor = GetBlendFactor(src, dst, constant, srcA).A();
+  float dstAFactor = GetBlendFactor(src, dst, constant, dstA).A();
+  switch (op) {
+    case hackri::BlendEquation::Add:
+      return Color4f(
+          src.XYZ() * srcRgbFactor + dst.XYZ() * dstRgbFactor,
+          src.A() * srcAFactor + dst.A() * dstAFactor);
+    case hackri::BlendEquation::Sub:
+      return Color4f(
+          src.XYZ() * srcRgbFactor - dst.XYZ() * dstRgbFactor,
+          src.A() * srcAFactor - dst.A() * dstAFactor);
+    case hackri::BlendEquation::RevSub:
+      return Color4f(
+          dst.XYZ() * dstRgbFactor - src.XYZ() * srcRgbFactor,
+          dst.A() * dstAFactor - src.A() * srcAFactor);
+    default:
+      return Color4f(0.0f);
+  }
+}
+//输出合并的目标，统一读写浮点和打包格式的颜色缓冲，打包格式读出来是线性的Color4f
+struct ColorTarget {
+  Buffer2d<Color4f>* Float;
+  Buffer2d<uint32_t>* Packed;
+  ColorFormat Format;
+
+  explicit ColorTarget(const PipelineInput& input) noexcept
+      : Float(input.ColorBuffer), Packed(input.PackedColorBuffer), Format(input.PackedColorFormat) {}
+  explicit ColorTarget(Buffer2d<Color4f>* buffer) noexcept
+      : Float(buffer), Packed(nullptr), Format(ColorFormat::RGBA8Unorm) {}
+
+  Color4f Load(uint32_t x, uint32_t y) const noexcept {
+    return Float != nullptr ? (*Float)(x, y) : UnpackColor((*Packed)(x, y), Format);
+  }
+  void Store(uint32_t x, uint32_t y, const Color4f& color) noexcept {
+    if (Float != nullptr) {
+      (*Float)(x, y) = color;
+    } else {
+      (*Packed)(x, y) = PackColor(color, Format);
+    }
+  }
+};
+
+//#############
+//# 三角形设置 #
+//#############
+//7个裁剪平面，每个平面最多切出2个新顶点
+constexpr size_t MAX_CLIP_NEW_VERTEX = 14;
+//三角形设置用的临时内存，每次draw分配一次，所有三角形共用
+struct SetupScratch {
+  Span<uint8_t> PsIn;   //线框模式画线时PS的输入，OutLayout.Size字节
+  Span<float> ClipOut;  //裁剪切出的新顶点的VS输出，MAX_CLIP_NEW_VERTEX个
+};
+SetupScratch AllocateSetupScratch(const PipelineState& pso, PipelineMemory& memory);
+//裁剪、剔除一个已经过VS的三角形，做完三角形设置后追加到triangles
+//线框模式下直接画线，不会追加
+//只有被裁剪的三角形才会从memory分配内存（保存新顶点的VS输出）
+//primitiveID是这个三角形在draw里的编号
+void SetupClipSpaceTriangle(
+    const PipelineInput& input,
+    const PipelineState& pso,
+    PipelineMemory& memory,
+    uint32_t primitiveID,
+    const Vector4f& clipPosA, const Vector4f& clipPosB, const Vector4f& clipPosC,
+    const Span<uint8_t>& vsOutA, const Span<uint8_t>& vsOutB, const Span<uint8_t>& vsOutC,
+    SetupScratch& scratch,
+    std::pmr::vector<TriangleSetup>& triangles);
+//sort-middle分块的结果，tile按x优先排列，和Buffer2d一样
+//第tile个tile里的三角形是Triangles[Start[tile], Start[tile + 1])，保持提交顺序
+struct TileBins {
+  uint32_t CountX, CountY;
+  Span<uint32_t> Start;
+  Span<uint32_t> Triangles;
+
+  constexpr size_t GetTileCount() const noexcept { return size_t(CountX) * CountY; }
+  //tile的范围，闭区间
+  constexpr Array<uint32_t, 4> GetTileRect(size_t tile, uint32_t width, uint32_t height) const noexcept {
+    uint32_t tx = uint32_t(tile / CountY);
+    uint32_t ty = uint32_t(tile % CountY);
+    return Array<uint32_t, 4>(
+        tx * TILE_SIZE, ty * TILE_SIZE,
+        std::min((tx + 1) * TILE_SIZE, width) - 1,
+        std::min((ty + 1) * TILE_SIZE, height) - 1);
+  }
+};
+//把三角形按包围盒分到tile里，内存从memory分配
+//hiz不为空时用它剔除完全被挡住的tile，只有深度单调变化的比较方式才能这样用（见IsHiZMonotonic）
+TileBins BinTriangles(
+    const PipelineInput& input,
+    PipelineMemory& memory,
+    const std::pmr::vector<TriangleSetup>& triangles,
+    HiZBuffer* hiz, TestComparison test);
+}  // namespace hackri
+
+#endif
@@ -3,10 +3,14 @@
 
 #include <hackri/mathematics.h>
 #include <hackri/buffer.h>
+#include <hackri/image.h>
 #include <hackri/memory_util.h>
+#include <hackri/thread_pool.h>
 #include <functional>
+#include <cassert>
 #include <memory>
 #include <memory_resource>
+#include <type_traits>
 
 namespace hackri {
 struct VertexShaderParams {
@@ -21,22 +25,196 @@ struct VertexShaderParams {
   template <class T>
   constexpr const T& CastCBuffer() const noexcept { return *reinterpret_cast<const T*>(CBuffer); }
 };
+//三角形按2x2的quad着色，quad里的像素按(x & 1) * 2 + (y & 1)编号
+//quad里没被覆盖的像素（helper）也会插值，给导数用，但是不运行PS
+constexpr size_t QUAD_PIXEL_COUNT = 4;
 struct PixelShaderParams {
   const uint8_t* PixelIn;  //像素着色器输入，只读
   const uint8_t* CBuffer;  //常量buffer，只读
+  //所在quad四个像素的输入，间隔QuadStride字节，PixelIn就是第QuadLane个
+  //粗粒度着色时quad由2x2个粗像素组成。画线和可见性缓冲没有quad，QuadIn为空
+  const uint8_t* QuadIn = nullptr;
+  size_t QuadStride = 0;
+  uint32_t QuadLane = 0;
 
   template <class T>
   constexpr const T& CastIn() const noexcept { return *reinterpret_cast<const T*>(PixelIn); }
   template <class T>
   constexpr const T& CastCBuffer() const noexcept { return *reinterpret_cast<const T*>(CBuffer); }
+  //屏幕空间导数，member必须是CastIn得到的输入里的成员（float或者Vector之类）
+  //DDX是f(x + 1) - f(x)，DDY是f(y + 1) - f(y)（y轴向上），quad里每行、每列分别相减，没有quad时是0
+  template <class T>
+  T DDX(const T& member) const noexcept { return QuadDifference(member, QuadLane & ~2u, QuadLane | 2u); }
+  template <class T>
+  T DDY(const T& member) const noexcept { return QuadDifference(member, QuadLane & ~1u, QuadLane | 1u); }
+  //quad里第to个像素的member减第from个像素的
+  template <class T>
+  T QuadDifference(const T& member, uint32_t from, uint32_t to) const noexcept {
+    if (QuadIn == nullptr) {
+      return member - member;
+    }
+    const size_t offset = reinterpret_cast<const uint8_t*>(&member) - PixelIn;
+    assert(offset + sizeof(T) <= QuadStride);  //不是PixelIn里的成员（比如复制出来的局部变量）
+    return *reinterpret_cast<const T*>(QuadIn + to * QuadStride + offset) -
+           *reinterpret_cast<const T*>(QuadIn + from * QuadStride + offset);
+  }
+};
+//批量VS一次处理8个连续编号的顶点，输入输出都是SoA
+//VertexLanes是某个float分量在这8个顶点上的值
+constexpr size_t VERTEX_BATCH_SIZE = 8;
+using VertexLanes = Array<float, VERTEX_BATCH_SIZE>;
+struct VertexBatchParams {
+  const uint8_t* Vertex;           //就是PipelineInput::Vertex，一般指向使用者自己定义的一组SoA数组，只读
+  const uint8_t* CBuffer;          //常量buffer，只读
+  size_t Start;                    //这一批的第一个顶点编号
+  size_t Count;                    //有效的顶点数量，1~8，读取顶点数据时不能越过它
+  Array<VertexLanes, 4>* ClipPos;  //输出齐次空间坐标，(*ClipPos)[0]是8个顶点的x，以此类推
+  float* Out;                      //输出，第i个float的8条lane是Out[i * VERTEX_BATCH_SIZE, (i + 1) * VERTEX_BATCH_SIZE)
+
+  template <class T>
+  constexpr const T& CastVertex() const noexcept { return *reinterpret_cast<const T*>(Vertex); }
+  template <class T>
+  constexpr const T& CastCBuffer() const noexcept { return *reinterpret_cast<const T*>(CBuffer); }
+  //读SoA数组里这一批的值，超过Count的lane填0
+  VertexLanes Load(const float* stream) const noexcept {
+    VertexLanes lanes;
+    for (size_t j = 0; j < VERTEX_BATCH_SIZE; j++) {
+      lanes[j] = j < Count ? stream[Start + j] : 0.0f;
+    }
+    return lanes;
+  }
+  constexpr void Store(size_t i, const VertexLanes& lanes) const noexcept {
+    for (size_t j = 0; j < VERTEX_BATCH_SIZE; j++) {
+      Out[i * VERTEX_BATCH_SIZE + j] = lanes[j];
+    }
+  }
+};
+//一次处理一列8个像素的PS输入，SoA排列
+//第i个float输入的8条lane是PixelIn[i * PIXEL_BATCH_SIZE, (i + 1) * PIXEL_BATCH_SIZE)
+//lane j对应像素(X, Y + j)，Mask里没有置位的lane不会被写入
+//粗粒度着色时lane j是从(X, Y + j * Rate)开始的Rate x Rate个像素，一列只有8 / Rate个有效的lane
+//三角形的一列总是整列插值，相邻的那一列也是（见NeighborIn），两列正好是一排quad
+constexpr size_t PIXEL_BATCH_SIZE = 8;
+using PixelLanes = Array<float, PIXEL_BATCH_SIZE>;
+struct PixelBatchParams {
+  const float* PixelIn;    //像素着色器输入，只读
+  const uint8_t* CBuffer;  //常量buffer，只读
+  uint32_t Mask;           //有效的lane
+  uint32_t X, Y;
+  const float* NeighborIn = nullptr;  //quad里另一列的输入，排列和PixelIn一样。可见性缓冲没有quad，为空
+  uint32_t Rate = 1;                  //着色率，见ShadingRate
+
+  //第i个float输入的8条lane
+  constexpr const float* GetLanes(size_t i) const noexcept { return PixelIn + i * PIXEL_BATCH_SIZE; }
+  //第i个float输入的屏幕空间导数，和PixelShaderParams::DDX、DDY一样按quad相减，NeighborIn为空时是0
+  PixelLanes DDX(size_t i) const noexcept {
+    PixelLanes result(0.0f);
+    if (NeighborIn != nullptr) {
+      const bool isRight = ((X / Rate) & 1) != 0;
+      const float* left = isRight ? NeighborIn : PixelIn;
+      const float* right = isRight ? PixelIn : NeighborIn;
+      for (size_t j = 0; j < PIXEL_BATCH_SIZE; j++) {
+        result[j] = right[i * PIXEL_BATCH_SIZE + j] - left[i * PIXEL_BATCH_SIZE + j];
+      }
+    }
+    return result;
+  }
+  PixelLanes DDY(size_t i) const noexcept {
+    PixelLanes result(0.0f);
+    if (NeighborIn != nullptr) {
+      const float* lanes = GetLanes(i);
+      for (size_t j = 0; j < PIXEL_BATCH_SIZE; j++) {
+        result[j] = lanes[j | 1] - lanes[j & ~size_t(1)];
+      }
+    }
+    return result;
+  }
+  template <class T>
+  constexpr const T& CastCBuffer() const noexcept { return *reinterpret_cast<const T*>(CBuffer); }
+};
+//批量PS的输出，同样是SoA
+struct PixelBatchResult {
+  alignas(32) float R[PIXEL_BATCH_SIZE];
+  alignas(32) float G[PIXEL_BATCH_SIZE];
+  alignas(32) float B[PIXEL_BATCH_SIZE];
+  alignas(32) float A[PIXEL_BATCH_SIZE];
+  uint32_t Discard;  //置位的lane被丢弃，调用前是0
+
+  constexpr Color4f GetColor(size_t j) const noexcept { return Color4f(R[j], G[j], B[j], A[j]); }
+  constexpr void SetColor(size_t j, const Color4f& c) noexcept {
+    R[j] = c.R(), G[j] = c.G(), B[j] = c.B(), A[j] = c.A();
+  }
 };
 //VS第一个参数是三角形编号，只有[0,1,2]，因为只处理三角形图元
 //返回齐次空间下的坐标
 using VertexShader = std::function<Vector4f(int, VertexShaderParams&)>;
 //PS没啥好说的，很正常的输入输出
 using PixelShader = std::function<Color4f(const PixelShaderParams&, bool&)>;
+//批量VS，只有DrawIndexed和Draw会用，每批写入8个顶点的ClipPos和Out
+using BatchVertexShader = std::function<void(const VertexBatchParams&)>;
+//批量PS，输入输出都是8个像素，方便着色器代码在像素之间向量化
+using BatchPixelShader = std::function<void(const PixelBatchParams&, PixelBatchResult&)>;
+//VS输出的插值方式
+enum class Interpolation {
+  Perspective,    //透视矫正插值（默认）
+  NoPerspective,  //屏幕空间线性插值，不需要1/w，适合屏幕空间的量
+  Flat,           //不插值，整个三角形都用第一个顶点（provoking vertex）的值，适合材质ID之类的整数
+  Centroid        //透视矫正插值，MSAA下部分覆盖的像素改在第一个被覆盖的采样上插值，不会外推到三角形外面（UV越出图集之类）
+};
+struct InterpolationRange {
+  size_t Offset;  //字节偏移，必须是sizeof(float)的整数倍
+  size_t Size;    //字节大小，必须是sizeof(float)的整数倍
+  Interpolation Mode;
+};
+constexpr size_t MAX_INTERPOLATION_RANGE = 8;
 struct VertexShaderOutLayout {
   size_t Size;  //输出数据大小（字节），必须是sizeof(float)的整数倍
+  //单独指定插值方式的范围，必须按偏移从小到大并且不重叠，没指定的部分都是透视矫正
+  InterpolationRange Ranges[MAX_INTERPOLATION_RANGE] = {};
+  size_t RangeCount = 0;
+
+  //[offset, offset + size)字节用mode插值，一般用offsetof(Out, Member)和sizeof(Out::Member)
+  VertexShaderOutLayout& SetInterpolation(size_t offset, size_t size, Interpolation mode) noexcept {
+    assert(RangeCount < MAX_INTERPOLATION_RANGE);
+    assert(offset % sizeof(float) == 0 && size % sizeof(float) == 0 && offset + size <= Size);
+    assert(RangeCount == 0 || Ranges[RangeCount - 1].Offset + Ranges[RangeCount - 1].Size <= offset);
+    Ranges[RangeCount++] = {offset, size, mode};
+    return *this;
+  }
+  //按顺序把所有float分成插值方式相同的区间[begin, end)，逐个调用func(begin, end, mode)
+  template <class Func>
+  void ForEachSegment(Func&& func) const {
+    const size_t count = Size / sizeof(float);
+    size_t cursor = 0;
+    for (size_t i = 0; i < RangeCount; i++) {
+      const size_t begin = Ranges[i].Offset / sizeof(float);
+      const size_t end = begin + Ranges[i].Size / sizeof(float);
+      if (cursor < begin) {
+        func(cursor, begin, Interpolation::Perspective);
+      }
+      if (begin < end) {
+        func(begin, end, Ranges[i].Mode);
+      }
+      cursor = end;
+    }
+    if (cursor < count) {
+      func(cursor, count, Interpolation::Perspective);
+    }
+  }
+  //有没有float需要透视矫正（包括Centroid），没有的话连1/w都不用插值
+  bool HasPerspective() const noexcept {
+    bool result = false;
+    ForEachSegment([&](size_t, size_t, Interpolation mode) {
+      result = result || mode == Interpolation::Perspective || mode == Interpolation::Centroid;
+    });
+    return result;
+  }
+  //有没有Centroid插值的float，只有MSAA光栅化时要为它找插值位置
+  bool HasCentroid() const noexcept {
+    bool result = false;
+    ForEachSegment([&](size_t, size_t, Interpolation mode) { result = result || mode == Interpolation::Centroid; });
+    return result;
+  }
 };
 enum class TestComparison {
   Never,
@@ -79,14 +257,24 @@ enum class BlendEquation {
   Sub,
   RevSub
 };
+//粗粒度着色，值就是一个粗像素的边长。三角形每个粗像素只运行一次PS，结果写进里面被覆盖的像素
+//覆盖和深度测试依然逐像素，所以深度边缘不会变糊
+enum class ShadingRate : uint8_t {
+  Rate1x1 = 1,
+  Rate2x2 = 2,
+  Rate4x4 = 4
+};
 //名字取自DX12的PSO（233
 struct PipelineState {
   VertexShader VS;
   PixelShader PS;
+  BatchVertexShader VSBatch;  //不为空时DrawIndexed用它代替VS，此时Vertex的格式由它自己决定
+  BatchPixelShader PSBatch;  //不为空时三角形光栅化用它代替PS，线框模式依然用PS
   size_t VertexSize;                //一个顶点大小（字节）
   VertexShaderOutLayout OutLayout;  //顶点着色器输出的布局
 
   bool IsDrawFrame = false;  //是不是线框模式
+  bool IsUseGuardBand = true;  //只超出视口边缘的三角形不做X、Y平面的裁剪，由包围盒剪掉。线框模式不使用
 
   bool IsUseDepthTest = true;
   TestComparison DepthTest = TestComparison::Less;  //深度比较
@@ -104,14 +292,50 @@ struct PipelineState {
 
   bool IsUseAlphaTest = false;  //alpha测试
   TestComparison AlphaTest = TestComparison::Always;
+
+  ShadingRate PixelShadingRate = ShadingRate::Rate1x1;  //三角形的着色率，线框模式和可见性缓冲不使用
 };
 struct PipelineInput {
   uint8_t* Vertex;   //顶点数据输入
   uint8_t* CBuffer;  //常量buffer
   uint32_t FrameWidth;
   uint32_t FrameHeight;
-  Buffer2d<Color4f>* ColorBuffer;  //最终颜色
+  Buffer2d<Color4f>* ColorBuffer;  //最终颜色，和PackedColorBuffer都为空时只写深度（z-prepass、阴影），不运行PS
   Buffer2d<float>* DepthBuffer;    //深度缓冲
+  HiZBuffer* HiZ = nullptr;        //可选，深度缓冲对应的Hi-Z，启用深度测试时用来整块剔除
+  //打包格式的颜色缓冲，ColorBuffer为空时才使用，混合在读出的线性值上做完再写回
+  Buffer2d<uint32_t>* PackedColorBuffer = nullptr;
+  ColorFormat PackedColorFormat = ColorFormat::RGBA8Unorm;
+  //定点深度缓冲，格式见DepthFormat，设置了其中一个时代替DepthBuffer
+  Buffer2d<uint16_t>* Depth16Buffer = nullptr;
+  Buffer2d<uint32_t>* Depth24Buffer = nullptr;
+  //可见性缓冲，不为空时三角形只做深度测试，通过的像素写入MakeVisibilityID(DrawID, 三角形编号)，不运行PS
+  //之后由Renderer::ShadeVisibility统一着色。不支持线框模式
+  Buffer2d<uint64_t>* VisibilityBuffer = nullptr;
+  uint32_t DrawID = 0;  //写进可见性缓冲的draw编号，也是ShadeVisibility里draws的下标
+  //多重采样的渲染目标，不为空时代替上面所有颜色和深度缓冲（包括Hi-Z）
+  //每个采样单独做覆盖和深度测试，PS在像素中心每个像素只运行一次，结果写进被覆盖的采样
+  //不支持线框模式和可见性缓冲，最后用Renderer::Resolve合并成普通的颜色缓冲
+  MultisampleBuffer* Multisample = nullptr;
+  //可选，每个8x8块一个着色率（宽高是帧的1/8，向上取整），和pso.PixelShadingRate取较粗的那个
+  const Buffer2d<ShadingRate>* ShadingRateImage = nullptr;
+
+  bool HasColorTarget() const noexcept {
+    return ColorBuffer != nullptr || PackedColorBuffer != nullptr || Multisample != nullptr;
+  }
+  //三角形光栅化时是不是要运行PS，不运行的话VS输出也不需要插值
+  bool IsShadePixel() const noexcept { return HasColorTarget() && VisibilityBuffer == nullptr; }
+  //T是深度缓冲的元素类型
+  template <class T>
+  Buffer2d<T>* GetDepthTarget() const noexcept {
+    if constexpr (std::is_same_v<T, uint16_t>) {
+      return Depth16Buffer;
+    } else if constexpr (std::is_same_v<T, uint32_t>) {
+      return Depth24Buffer;
+    } else {
+      return DepthBuffer;
+    }
+  }
 };
 struct PipelineContext {
   uint8_t* VsOut;     //需要长度是PSO里面的OutLayout.Size * 3
@@ -121,6 +345,8 @@ struct PipelineContext {
 };
 struct PipelineMemory {
   std::pmr::monotonic_buffer_resource* Arena;  //管线执行时内存分配器
+  //不为空时使用分块多线程光栅化（线框模式除外），此时PS会被多个线程同时调用
+  ThreadPool* Workers = nullptr;
 
   template <class T>
   T* Allocate(size_t count, size_t align = alignof(std::max_align_t)) {
@@ -132,6 +358,37 @@ struct PipelineMemory {
   }
 };
 
+//可见性缓冲的元素，高32位是draw编号，低32位是draw里的三角形编号（索引/3）
+//没有被任何三角形覆盖的像素是VISIBILITY_EMPTY，可见性缓冲要先Fill(VISIBILITY_EMPTY)
+constexpr uint64_t VISIBILITY_EMPTY = ~uint64_t(0);
+constexpr uint64_t MakeVisibilityID(uint32_t draw, uint32_t primitive) noexcept {
+  return (uint64_t(draw) << 32) | primitive;
+}
+constexpr uint32_t GetVisibilityDraw(uint64_t id) noexcept { return uint32_t(id >> 32); }
+constexpr uint32_t GetVisibilityPrimitive(uint64_t id) noexcept { return uint32_t(id); }
+//ShadeVisibility重建三角形需要的一次DrawIndexed的全部输入，和第一遍绘制时一样
+struct VisibilityDraw {
+  const PipelineState* PSO;
+  uint8_t* Vertex;
+  uint8_t* CBuffer;
+  const size_t* Indices;
+  size_t IndexCount;
+};
+
+//颜色缓冲转换到Bitmap时的选项
+struct ResolveOptions {
+  bool IsSrgb = false;         //RGB先做sRGB编码，A不变
+  bool IsBGRA = true;          //每个像素按B、G、R、A的字节顺序存储（保存BMP用的顺序），否则是R、G、B、A
+  bool IsFlipVertical = true;  //Buffer2d的y轴向上，Bitmap的第0行在最上面，所以一般都要翻转
+};
+
+//FXAA的参数，默认值和FXAA 3.11默认的质量档一样
+struct FXAAOptions {
+  float EdgeThreshold = 0.125f;      //局部亮度差小于最大亮度的这个比例时不算边缘
+  float EdgeThresholdMin = 0.0312f;  //暗部的亮度差阈值，低于它也不算边缘
+  float SubpixelQuality = 0.75f;     //子像素走样的平滑程度，0是关闭
+};
+
 class Renderer {
  public:
   static void DrawLine(
@@ -169,10 +426,61 @@ class Renderer {
       const PipelineInput& input,
       const PipelineState& pso,
       PipelineMemory& memory);
+  //按索引绘制三角形列表，input.Vertex是顶点数组，每个顶点大小是pso.VertexSize
+  //每个被引用的顶点只运行一次VS，结果存入post-transform cache，之后由缓存的结果装配三角形
+  //此时VertexShaderParams::Vertex直接指向当前顶点，VS的三角形编号恒为0，只需要写Out[0]
+  //缓存从memory里分配，大小是(最大索引+1) * (sizeof(Vector4f) + OutLayout.Size)
+  //设置了VSBatch时按8个顶点一批运行，有Workers的话多线程运行，只跳过完全没被引用的批
+  static void DrawIndexed(
+      const PipelineInput& input,
+      const size_t* indices, size_t indexCount,
+      const PipelineState& pso,
+      PipelineMemory& memory);
+
+  //DrawIndexed的编译期特化版本，实现在pipeline.h，使用时需要包含它
+  //VS、PS是任意可调用对象（比如lambda），签名和VertexShader、PixelShader一样
+  //深度测试和颜色混合由Depth、Blend决定（比如DepthLess、BlendAlpha），pso里的VS、PS、深度和混合设置会被忽略
+  //着色器和这些状态都在编译期确定，整条像素路径可以被完全内联。不支持线框模式
+  template <class Depth, class Blend, class VS, class PS>
+  static void Draw(
+      const PipelineInput& input,
+      const size_t* indices, size_t indexCount,
+      const PipelineState& pso,
+      PipelineMemory& memory,
+      const VS& vs, const PS& ps);
+
+  //可见性缓冲的第二遍：每个可见像素只运行一次PS
+  //按像素的可见性ID找到draws里对应的draw和三角形，重新运行VS（每个被引用的顶点一次），
+  //用裁剪空间坐标直接算出透视矫正的重心坐标，插值VS输出后运行PS，结果经过OutputMerge写进input的颜色目标
+  //input里只用到颜色目标（ColorBuffer或PackedColorBuffer，不能是Multisample）、VisibilityBuffer和帧大小，
+  //memory.Workers不为空时按64x64的tile多线程着色
+  static void ShadeVisibility(
+      const PipelineInput& input,
+      const VisibilityDraw* draws, size_t drawCount,
+      PipelineMemory& memory);
 
   static PipelineState DefaultPSO(
       VertexShader vs, PixelShader ps,
       size_t vertexSize, size_t outSize) noexcept;
+
+  //把颜色缓冲转换成8位unorm（四舍五入，和PackColor一致）写进target，宽高必须一样
+  //按64x64的tile处理，workers不为空时多线程，待清除的tile直接填充清除值
+  static void Resolve(
+      const Buffer2d<Color4f>& color, Bitmap& target,
+      const ResolveOptions& options = {},
+      ThreadPool* workers = nullptr);
+  //屏幕空间的边缘抗锯齿（FXAA），读source写target，宽高必须一样，不能是同一个缓冲，一般在Resolve之前做
+  //先算出整张图的亮度（从memory.Arena分配，调用者负责释放），再按64x64的tile找出局部对比度够大的像素，
+  //沿边缘搜索并混合后写进target，其他像素原样复制。memory.Workers不为空时多线程
+  static void ApplyFXAA(
+      const Buffer2d<Color4f>& source, Buffer2d<Color4f>& target,
+      PipelineMemory& memory,
+      const FXAAOptions& options = {});
+  //把多重采样的颜色取平均写进target，宽高必须一样。压缩的像素直接复制
+  //按64x64的tile、每次一列8个像素处理，workers不为空时多线程
+  static void Resolve(
+      const MultisampleBuffer& source, Buffer2d<Color4f>& target,
+      ThreadPool* workers = nullptr);
 };
 }  // namespace hackri
 
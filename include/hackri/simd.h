@@ -0,0 +1,45 @@
+#ifndef __HACKRI_SIMD_H__
+#define __HACKRI_SIMD_H__
+
+#include <cstdint>
+
+//x86-64平台才有SSE/AVX实现（SSE2是x86-64的基础指令集），其他平台只有标量实现
+#if !defined(HACKRI_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#define HACKRI_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+//GCC/Clang需要给用到AVX2的函数单独标上target，这样整个程序不需要-mavx2，在不支持AVX2的机器上也能跑
+//MSVC可以直接使用intrinsics，不需要标记
+#if defined(_MSC_VER) && !defined(__clang__)
+#define HACKRI_TARGET_AVX2
+#else
+#define HACKRI_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+namespace hackri {
+enum class SimdLevel {
+  Scalar,
+  SSE2,
+  AVX2
+};
+//运行时检测CPU支持的指令集，只检测一次
+//可以用环境变量HACKRI_SIMD=scalar/sse2/avx2强制使用更低的级别，方便对比
+SimdLevel GetSimdLevel() noexcept;
+
+inline int CountTrailingZero(uint64_t v) noexcept {
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward64(&index, v);
+  return (int)index;
+#else
+  return __builtin_ctzll(v);
+#endif
+}
+}  // namespace hackri
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __HACKRI_THREAD_POOL_H__
+#define __HACKRI_THREAD_POOL_H__
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+namespace hackri {
+//很简单的线程池，只有ParallelFor一种用法
+//调用ParallelFor的线程自己也会干活，所以工作线程数量是threadCount - 1
+class ThreadPool {
+ public:
+  //第一个参数是任务编号，第二个参数是工作线程编号，范围[0, GetWorkerCount())
+  using Task = std::function<void(size_t, size_t)>;
+
+  explicit ThreadPool(size_t threadCount = std::thread::hardware_concurrency());
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ~ThreadPool();
+
+  size_t GetWorkerCount() const noexcept { return _threads.size() + 1; }
+
+  //执行[0, count)的所有任务，全部完成后才返回。同一时间只能有一个线程调用
+  void ParallelFor(size_t count, const Task& task);
+
+ private:
+  void WorkerLoop(size_t worker);
+  void RunTasks(const Task& task, size_t count, size_t worker);
+
+  std::vector<std::thread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _wakeCv;
+  std::condition_variable _doneCv;
+  const Task* _task = nullptr;
+  size_t _count = 0;
+  std::atomic<size_t> _next{0};
+  size_t _busy = 0;
+  uint64_t _generation = 0;
+  bool _isExit = false;
+};
+}  // namespace hackri
+
+#endif
@@ -0,0 +1,222 @@
+#include <hackri/renderer.h>
+#include <hackri/simd.h>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace hackri;
+
+//不依赖测试框架，失败的检查打印出来，最后由返回值告诉CTest
+static int failCount = 0;
+static void Check(bool isPass, const char* name) {
+  if (!isPass) {
+    std::printf("FAILED: %s\n", name);
+    failCount++;
+  }
+}
+
+struct VertexPC {
+  Vector4f Pos;
+  Color4f Color;
+};
+
+//逐位hash，浮点数按位比较，保证结果逐位相同
+struct Hasher {
+  uint64_t Value = 1469598103934665603ull;
+  void Add(const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+      Value = (Value ^ bytes[i]) * 1099511628211ull;
+    }
+  }
+};
+
+//#############
+//# 缓冲区 #
+//#############
+//快速清除：写入只影响所在的tile，其他tile依然是待清除的，const访问读到清除值
+static void CheckFastClear(BufferLayout layout) {
+  Buffer2d<float> buffer(130, 70, BufferOptions{layout});
+  buffer.Fill(0.5f);
+  Check(buffer.IsPendingClear(0, 0) && buffer.IsPendingClear(129, 69), "fast clear marks every tile pending");
+  buffer(70, 10) = 1.0f;
+  Check(!buffer.IsPendingClear(70, 10) && buffer.IsPendingClear(0, 0), "write materializes only its own tile");
+  Check(buffer(71, 10) == 0.5f && buffer(127, 63) == 0.5f, "materialized tile keeps the clear value");
+  const Buffer2d<float>& view = buffer;
+  Check(view(0, 0) == 0.5f && view(129, 69) == 0.5f, "const access reads the clear value");
+  double sum = 0;
+  view.ForEach([&](uint32_t, uint32_t, const float& value) { sum += value; });
+  Check(sum == 130 * 70 * 0.5 + 0.5, "ForEach sees pending tiles as the clear value");
+  buffer.Fill(0.25f);
+  Check(view(70, 10) == 0.25f, "Fill discards earlier writes");
+}
+//Tiled和Linear布局读写的结果一样，宽高不是tile的整数倍
+static void CheckTiledLayout() {
+  const uint32_t width = 200, height = 131;
+  Buffer2d<uint32_t> linear(width, height, BufferLayout::Linear);
+  Buffer2d<uint32_t> tiled(width, height, BufferLayout::Tiled);
+  for (uint32_t x = 0; x < width; x++) {
+    for (uint32_t y = 0; y < height; y++) {
+      linear(x, y) = x * 1000 + y;
+      tiled(x, y) = x * 1000 + y;
+    }
+  }
+  const Buffer2d<uint32_t> copy(tiled);
+  bool isSame = true;
+  for (uint32_t x = 0; x < width; x++) {
+    for (uint32_t y = 0; y < height; y++) {
+      isSame = isSame && linear(x, y) == x * 1000 + y && tiled(x, y) == x * 1000 + y && copy(x, y) == x * 1000 + y;
+    }
+  }
+  Check(isSame, "tiled layout round trip");
+}
+//打包格式：存储值解包再打包回来不变
+static void CheckPackedFormat() {
+  bool isSame = true;
+  for (uint32_t i = 0; i < 1024; i++) {
+    const uint32_t rgba8 = (i & 0xff) | ((255 - (i & 0xff)) << 8) | ((i * 7 & 0xff) << 16) | ((i >> 2) << 24);
+    const uint32_t rgb10a2 = i | ((1023 - i) << 10) | ((i * 7 & 1023) << 20) | ((i & 3) << 30);
+    isSame = isSame && PackColor(UnpackColor(rgba8, ColorFormat::RGBA8Unorm), ColorFormat::RGBA8Unorm) == rgba8;
+    isSame = isSame && PackColor(UnpackColor(rgba8, ColorFormat::RGBA8Srgb), ColorFormat::RGBA8Srgb) == rgba8;
+    isSame = isSame && PackColor(UnpackColor(rgb10a2, ColorFormat::RGB10A2Unorm), ColorFormat::RGB10A2Unorm) == rgb10a2;
+  }
+  Check(isSame, "packed format round trip");
+}
+//###########
+//# 渲染 #
+//###########
+struct SceneOptions {
+  BufferLayout Layout = BufferLayout::Linear;
+  ThreadPool* Workers = nullptr;
+  bool IsPacked = false;
+};
+//随机三角形，带深度测试和Hi-Z，之后再叠一层alpha混合，每帧都重新Fill（包括Hi-Z）
+//返回所有帧颜色和深度的hash
+static uint64_t RenderScene(const SceneOptions& options) {
+  constexpr uint32_t width = 301, height = 203;
+  constexpr int frameCount = 3;
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> pos(-1.3f, 1.3f), unit(0.0f, 1.0f);
+  std::vector<VertexPC> vertices;
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < 3000; i++) {
+    const float w = 0.5f + unit(rng) * 2.0f;
+    vertices.push_back({Vector4f(pos(rng) * w, pos(rng) * w, pos(rng) * w, w), Color4f(unit(rng), unit(rng), unit(rng), unit(rng))});
+    indices.push_back(i);
+  }
+  auto vs = [](int index, VertexShaderParams& param) -> Vector4f {
+    const VertexPC& v = param.CastVertex<VertexPC>()[index];
+    param.CastOut<Color4f>(index) = v.Color;
+    return v.Pos;
+  };
+  auto ps = [](const PixelShaderParams& param, bool&) -> Color4f { return param.CastIn<Color4f>(); };
+  PipelineState opaque = Renderer::DefaultPSO(vs, ps, sizeof(VertexPC), sizeof(Color4f));
+  PipelineState blend = opaque;
+  blend.IsUseBlend = true;
+  blend.BlendSrcFactorRGB = BlendColor::SrcAlpha;
+  blend.BlendDstFactorRGB = BlendColor::OneMinusSrcAlpha;
+
+  const BufferOptions bufferOptions{options.Layout, false};
+  ColorBuffer color(width, height, bufferOptions);
+  Buffer2d<uint32_t> packed(width, height, bufferOptions);
+  DepthBuffer depth(width, height, bufferOptions);
+  HiZBuffer hiz(width, height);
+  PipelineInput input{reinterpret_cast<uint8_t*>(vertices.data()), nullptr, width, height, &color, &depth};
+  input.HiZ = &hiz;
+  if (options.IsPacked) {
+    input.ColorBuffer = nullptr;
+    input.PackedColorBuffer = &packed;
+    input.PackedColorFormat = ColorFormat::RGBA8Srgb;
+  }
+  std::pmr::monotonic_buffer_resource arena(1 << 16);
+  PipelineMemory memory;
+  memory.Arena = &arena;
+  memory.Workers = options.Workers;
+  Hasher hasher;
+  for (int frame = 0; frame < frameCount; frame++) {
+    const bool isReverseZ = frame == 1;
+    opaque.DepthTest = isReverseZ ? TestComparison::Greater : TestComparison::Less;
+    blend.DepthTest = opaque.DepthTest;
+    color.Fill(Color4f(0.1f, 0.2f, 0.3f, 1.0f));
+    packed.Fill(PackColor(Color4f(0.1f, 0.2f, 0.3f, 1.0f), input.PackedColorFormat));
+    depth.Fill(isReverseZ ? 0.0f : 1.0f);
+    hiz.Fill(isReverseZ ? 0.0f : 1.0f);
+    Renderer::DrawIndexed(input, indices.data(), indices.size() / 2, opaque, memory);
+    arena.release();
+    Renderer::DrawIndexed(input, indices.data() + indices.size() / 2, indices.size() / 2, blend, memory);
+    arena.release();
+    //Hi-Z必须是保守的，多线程同时更新时丢失的写入会让某个块的范围缩回清除值
+    bool isConservative = true;
+    for (uint32_t x = 0; x < width; x++) {
+      for (uint32_t y = 0; y < height; y++) {
+        const HiZBuffer::Range& block = hiz.GetBlock(x / HiZBuffer::BLOCK_SIZE, y / HiZBuffer::BLOCK_SIZE);
+        const HiZBuffer::Range& coarse = hiz.GetCoarse(x / HiZBuffer::COARSE_SIZE, y / HiZBuffer::COARSE_SIZE);
+        isConservative = isConservative && block[0] <= depth(x, y) && depth(x, y) <= block[1] &&
+                         coarse[0] <= block[0] && block[1] <= coarse[1];
+      }
+    }
+    Check(isConservative, "Hi-Z covers the depth buffer");
+    for (uint32_t x = 0; x < width; x++) {
+      for (uint32_t y = 0; y < height; y++) {
+        if (options.IsPacked) {
+          hasher.Add(&packed(x, y), sizeof(uint32_t));
+        } else {
+          hasher.Add(&color(x, y), sizeof(Color4f));
+        }
+        hasher.Add(&depth(x, y), sizeof(float));
+      }
+    }
+  }
+  return hasher.Value;
+}
+//单线程Linear是参考，多线程和Tiled布局都必须逐位相同
+static std::vector<uint64_t> CheckRender() {
+  ThreadPool workers(4);
+  std::vector<uint64_t> result;
+  for (bool isPacked : {false, true}) {
+    SceneOptions options;
+    options.IsPacked = isPacked;
+    const uint64_t reference = RenderScene(options);
+    options.Workers = &workers;
+    Check(RenderScene(options) == reference, isPacked ? "packed: 1 worker vs 4 workers" : "1 worker vs 4 workers");
+    options.Layout = BufferLayout::Tiled;
+    Check(RenderScene(options) == reference, isPacked ? "packed: linear vs tiled" : "linear vs tiled");
+    result.push_back(reference);
+  }
+  return result;
+}
+
+//参数：--write path 把渲染结果的hash写进path；--compare path 和path里的hash比较
+//CTest用默认的SIMD级别写一次，再用HACKRI_SIMD=scalar/sse2各比较一次
+int main(int argc, char** argv) {
+  const char* levels[] = {"scalar", "sse2", "avx2"};
+  std::printf("simd level: %s\n", levels[(int)GetSimdLevel()]);
+  CheckFastClear(BufferLayout::Linear);
+  CheckFastClear(BufferLayout::Tiled);
+  CheckTiledLayout();
+  CheckPackedFormat();
+  const std::vector<uint64_t> hashes = CheckRender();
+  if (argc == 3 && std::strcmp(argv[1], "--write") == 0) {
+    FILE* file = std::fopen(argv[2], "w");
+    Check(file != nullptr, "open reference file");
+    if (file != nullptr) {
+      for (uint64_t hash : hashes) {
+        std::fprintf(file, "%016llx\n", (unsigned long long)hash);
+      }
+      std::fclose(file);
+    }
+  } else if (argc == 3 && std::strcmp(argv[1], "--compare") == 0) {
+    FILE* file = std::fopen(argv[2], "r");
+    Check(file != nullptr, "open reference file");
+    if (file != nullptr) {
+      for (uint64_t hash : hashes) {
+        unsigned long long expected = 0;
+        Check(std::fscanf(file, "%llx", &expected) == 1 && expected == hash, "scalar/SIMD kernels match the reference");
+      }
+      std::fclose(file);
+    }
+  }
+  std::printf("%d failed\n", failCount);
+  return failCount == 0 ? 0 : 1;
+}